@@ -1,3 +1,4 @@
 _loop:
 sys #2
+wai
 jmp _loop
\ No newline at end of file
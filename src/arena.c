@@ -0,0 +1,60 @@
+#include "arena.h"
+
+#define ARENA_ALIGNMENT 16
+
+void arenaInit(Arena* arena, size_t blockSize) {
+    arena->blocks = NULL;
+    arena->blockSize = blockSize > 0 ? blockSize : ARENA_BLOCK_SIZE;
+}
+
+static ArenaBlock* arenaAddBlock(Arena* arena, size_t size) {
+    size_t capacity = size > arena->blockSize ? size : arena->blockSize;
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + capacity);
+    block->size = capacity;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    return block;
+}
+
+void* arenaAlloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    ArenaBlock* block = arena->blocks;
+    if(block == NULL || block->size - block->used < size) {
+        block = arenaAddBlock(arena, size);
+    }
+    void* memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+//Keeps the biggest block, so an arena that is reused settles on a size that fits
+void arenaReset(Arena* arena) {
+    ArenaBlock* biggest = NULL;
+    ArenaBlock* block = arena->blocks;
+    while(block != NULL) {
+        ArenaBlock* next = block->next;
+        if(biggest == NULL || block->size > biggest->size) {
+            free(biggest);
+            biggest = block;
+        } else {
+            free(block);
+        }
+        block = next;
+    }
+    if(biggest != NULL) {
+        biggest->used = 0;
+        biggest->next = NULL;
+    }
+    arena->blocks = biggest;
+}
+
+void arenaDestroy(Arena* arena) {
+    ArenaBlock* block = arena->blocks;
+    while(block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
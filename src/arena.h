@@ -0,0 +1,26 @@
+#ifndef FAKEOS_ARENA_H
+#define FAKEOS_ARENA_H
+#include <stdlib.h>
+
+#define ARENA_BLOCK_SIZE 65536 //Default for blocks, bigger allocations get a block of their own
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    unsigned char data[];
+} ArenaBlock;
+
+//Bump allocator for data that all dies at the same time. Nothing is freed on its own,
+//arenaReset drops everything at once and keeps one block around for the next use.
+typedef struct {
+    ArenaBlock* blocks; //Newest first, only the first one still has room
+    size_t blockSize;
+} Arena;
+
+void arenaInit(Arena* arena, size_t blockSize);
+void* arenaAlloc(Arena* arena, size_t size);
+void arenaReset(Arena* arena);
+void arenaDestroy(Arena* arena);
+
+#endif //FAKEOS_ARENA_H
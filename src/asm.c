@@ -1,21 +1,71 @@
+#include <limits.h>
+#include <string.h>
 #include "asm.h"
+#include "heap.h"
+#include "jit.h"
+#include "record.h"
+
+//Emulated cycles per opcode, roughly how much work each one does
+static const unsigned char defaultCycleCosts[] = {
+        [NOP] = 1, [SYS] = 10,
+        [MOV] = 1, [ADD] = 1, [SUB] = 1, [MUL] = 3, [DIV] = 12,
+        [JMP] = 2, [JEQ] = 2, [JNE] = 2, [JLT] = 2, [JGT] = 2,
+        [BRN] = 3, [BEQ] = 3, [BNE] = 3, [BLT] = 3, [BGT] = 3,
+        [CMP] = 1, [RET] = 3,
+        [ALC] = 20, [FRE] = 10, [STB] = 2, [LDB] = 2,
+        [SPX] = 2, [CLS] = 200,
+        [STW] = 2, [LDW] = 2, [CPY] = 4, [FIL] = 4, [BNK] = 2,
+        [VLD] = 4, [SPD] = 4, [SPR] = 4,
+        [COL] = 1, [PEN] = 1, [HLN] = 2, [LIN] = 4, [REC] = 4, [BOX] = 4,
+        [TIL] = 4, [SCR] = 1,
+        [WAI] = 1, [INP] = 1,
+};
+#define BULK_BYTES_PER_CYCLE 16 //Bulk memory, sprite and drawing opcodes also pay for the bytes they write
 
 VM* vmCreate() {
+    return vmCreateWithMemory(MEMORY_SIZE);
+}
+
+VM* vmCreateWithMemory(unsigned int memorySize) {
+    if(memorySize < MIN_MEMORY_SIZE) {
+        memorySize = MIN_MEMORY_SIZE;
+    } else if(memorySize > MAX_MEMORY_SIZE) {
+        memorySize = MAX_MEMORY_SIZE;
+    }
+
     VM *vm = malloc(sizeof(VM));
-    vm->memory = malloc(16000); //16KB
-    vm->memoryMap = malloc(16000);
-    vm->memorySizes = malloc(16000);
-    //Initialize memory
-    for (int i = 0; i < 16000; i++) {
-        vm->memory[i] = 0;
-        vm->memoryMap[i] = false;
-        vm->memorySizes[i] = 0;
-    }
-    for (int i = 0; i < 16; ++i) {
+    vm->memorySize = memorySize;
+    vm->heapSize = memorySize < BANK_WINDOW ? memorySize : BANK_WINDOW;
+    vm->memory = calloc(memorySize, 1);
+    vm->memoryMap = malloc(memorySize);
+    vm->memorySizes = calloc(vm->heapSize, sizeof(unsigned short));
+    //Banked memory is never allocated, it is always usable
+    memset(vm->memoryMap, false, vm->heapSize);
+    memset(vm->memoryMap + vm->heapSize, true, memorySize - vm->heapSize);
+    unsigned int protectPages = (memorySize + (1 << PROTECT_PAGE_SHIFT) - 1) >> PROTECT_PAGE_SHIFT;
+    vm->pageFlags = malloc(protectPages);
+    memset(vm->pageFlags, PAGE_READ | PAGE_WRITE, protectPages);
+    heapCreate(vm);
+
+    vm->bankCount = memorySize > BANK_WINDOW ? (memorySize - BANK_WINDOW + BANK_SIZE - 1) / BANK_SIZE : 0;
+    for (int i = 0; i < 4; i++) {
+        vm->bankOffsets[i] = 0;
+    }
+    vmSetBank(vm, 0);
+
+    for (int i = 0; i <= REGISTER_COUNT; ++i) {
         vm->registers[i] = 0;
     }
+    vm->generation = 1;
+    vm->memoryPages = (memorySize + (1 << MEMORY_PAGE_SHIFT) - 1) >> MEMORY_PAGE_SHIFT;
+    vm->pageVersions = calloc(vm->memoryPages, sizeof(unsigned int));
     vm->codeLength = 0;
     vm->code = NULL;
+    vm->program = NULL;
+    vm->programLength = 0;
+    vm->addressMap = NULL;
+    vm->useJit = false;
+    vm->jit = NULL;
     vm->ip = 0;
     vm->sp = 0;
     vm->cp = 0;
@@ -23,411 +73,1019 @@ VM* vmCreate() {
     vm->cmpFlags = 0;
     vm->interrupt = false;
     vm->sysCallCount = 0;
+    vm->recorder = NULL;
     vm->debugger = NULL;
+    vm->host = NULL;
+    vm->buffers[0] = NULL;
+    vm->buffers[1] = NULL;
+    vm->videoMemory = calloc(VIDEO_MEMORY_SIZE, 1);
+    memset(vm->videoPageVersions, 0, sizeof(vm->videoPageVersions));
+    memset(vm->sprites, 0, sizeof(vm->sprites));
+    vm->drawColor = 0;
+    vm->penX = 0;
+    vm->penY = 0;
+    memset(&vm->tilemap, 0, sizeof(vm->tilemap));
+    vm->cycles = 0;
+    vm->budget = 0;
+    for (int i = 0; i < 256; i++) {
+        vm->cycleCosts[i] = 0;
+    }
+    for (int op = 0; op < sizeof(defaultCycleCosts); op++) {
+        vmSetCycleCost(vm, op, defaultCycleCosts[op]);
+    }
     return vm;
 }
 
+//Screens and the host context belong to the host
+void vmDestroy(VM* vm) {
+    recorderClose(vm);
+    jitDestroy(vm->jit);
+    free(vm->memory);
+    free(vm->memoryMap);
+    free(vm->memorySizes);
+    heapDestroy(vm->heap);
+    free(vm->pageFlags);
+    free(vm->pageVersions);
+    free(vm->videoMemory);
+    free(vm->code);
+    free(vm->program);
+    free(vm->addressMap);
+    free(vm);
+}
+
+typedef enum {
+    DECODE_OK,
+    DECODE_UNKNOWN_OPCODE,
+    DECODE_EXPECTED_REGISTER,
+    DECODE_EXPECTED_REGISTER_VALUE,
+    DECODE_INVALID_REGISTER,
+    DECODE_END_OF_PROGRAM,
+} DecodeError;
+
+static const char* decodeErrors[] = {
+        "",
+        "Unknown opcode",
+        "Expected register",
+        "Expected Register value",
+        "Invalid register",
+        "Unexpected end of program",
+};
+
+typedef struct {
+    unsigned char* code;
+    unsigned int length;
+    unsigned int ip;
+    DecodeError error;
+} Decoder;
+
+static void decodeFail(Decoder* decoder, DecodeError error) {
+    //Keep the first error, that is the one the instruction would have hit
+    if(decoder->error == DECODE_OK) {
+        decoder->error = error;
+    }
+}
+
+static unsigned char decodeByte(Decoder* decoder) {
+    if(decoder->ip >= decoder->length) {
+        decodeFail(decoder, DECODE_END_OF_PROGRAM);
+        decoder->ip++;
+        return 0;
+    }
+    unsigned char byte = decoder->code[decoder->ip];
+    decoder->ip++;
+    return byte;
+}
+
+static unsigned char decodeRegister(Decoder* decoder) {
+    unsigned char reg = decodeByte(decoder);
+    if(reg >= REGISTER_COUNT) {
+        decodeFail(decoder, DECODE_INVALID_REGISTER);
+        return ZERO_REGISTER;
+    }
+    return reg;
+}
+
+static Operand decodeOperand(Decoder* decoder) {
+    Operand operand = {ZERO_REGISTER, 0};
+    unsigned char low = decodeByte(decoder);
+    switch(low) {
+        case IMS: {
+            unsigned char a = decodeByte(decoder);
+            unsigned char b = decodeByte(decoder);
+            operand.value = (b << 8) | a;
+            break;
+        }
+        case IMB: {
+            operand.value = decodeByte(decoder);
+            break;
+        }
+        case REG: {
+            operand.reg = decodeRegister(decoder);
+            break;
+        }
+        default:
+            operand.value = low;
+    }
+    return operand;
+}
+
+static unsigned char decodeDestination(Decoder* decoder, DecodeError error) {
+    if(decoder->ip < decoder->length && decoder->code[decoder->ip] != REG) {
+        decodeFail(decoder, error);
+        decodeOperand(decoder);
+        return 0;
+    }
+    decoder->ip++;
+    unsigned char reg = decodeRegister(decoder);
+    return reg == ZERO_REGISTER ? 0 : reg;
+}
+
+static Instruction decodeInstruction(Decoder* decoder) {
+    Instruction ins;
+    ins.address = decoder->ip;
+    ins.dst = 0;
+    ins.target = NO_INSTRUCTION;
+    for (int i = 0; i < 3; i++) {
+        ins.args[i] = (Operand){ZERO_REGISTER, 0};
+    }
+    decoder->error = DECODE_OK;
+
+    ins.op = decodeByte(decoder);
+    switch (ins.op) {
+        case NOP:
+        case RET:
+        case WAI:
+            break;
+        case SYS:
+        case JMP:
+        case JEQ:
+        case JNE:
+        case JLT:
+        case JGT:
+        case BRN:
+        case BEQ:
+        case BNE:
+        case BLT:
+        case BGT:
+        case FRE:
+        case CLS:
+        case BNK:
+        case COL:
+        case TIL:
+            ins.args[0] = decodeOperand(decoder);
+            break;
+        case MOV:
+        case INP:
+            ins.dst = decodeDestination(decoder, DECODE_EXPECTED_REGISTER);
+            ins.args[0] = decodeOperand(decoder);
+            break;
+        case ALC:
+            ins.dst = decodeDestination(decoder, DECODE_EXPECTED_REGISTER_VALUE);
+            ins.args[0] = decodeOperand(decoder);
+            break;
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+            ins.dst = decodeDestination(decoder, DECODE_EXPECTED_REGISTER);
+            ins.args[0] = decodeOperand(decoder);
+            ins.args[1] = decodeOperand(decoder);
+            break;
+        case CMP:
+        case SPD:
+        case PEN:
+        case LIN:
+        case REC:
+        case BOX:
+        case SCR:
+            ins.args[0] = decodeOperand(decoder);
+            ins.args[1] = decodeOperand(decoder);
+            break;
+        case STB:
+        case STW:
+        case SPX:
+        case CPY:
+        case FIL:
+        case VLD:
+        case SPR:
+        case HLN:
+            ins.args[0] = decodeOperand(decoder);
+            ins.args[1] = decodeOperand(decoder);
+            ins.args[2] = decodeOperand(decoder);
+            break;
+        case LDB:
+        case LDW:
+            ins.args[0] = decodeOperand(decoder);
+            ins.args[1] = decodeOperand(decoder);
+            ins.dst = decodeDestination(decoder, DECODE_EXPECTED_REGISTER);
+            break;
+        default:
+            decodeFail(decoder, DECODE_UNKNOWN_OPCODE);
+    }
+
+    if(decoder->error != DECODE_OK) {
+        ins.op = BAD;
+        ins.dst = decoder->error;
+    }
+    return ins;
+}
+
+static bool isJump(unsigned char op) {
+    return (op >= JMP && op <= BGT);
+}
+
+unsigned int vmResolveAddress(VM* vm, unsigned short address) {
+    if(address >= vm->codeLength) {
+        return vm->programLength;
+    }
+    return vm->addressMap[address];
+}
+
+//Each superinstruction and the pair of opcodes it replaces
+static const unsigned char fusedPairs[][3] = {
+        {CMP_JEQ, CMP, JEQ}, {CMP_JNE, CMP, JNE}, {CMP_JLT, CMP, JLT}, {CMP_JGT, CMP, JGT},
+        {CMP_BEQ, CMP, BEQ}, {CMP_BNE, CMP, BNE}, {CMP_BLT, CMP, BLT}, {CMP_BGT, CMP, BGT},
+        {MOV_ADD, MOV, ADD}, {STB_STB, STB, STB},
+};
+#define FUSED_PAIR_COUNT (sizeof(fusedPairs) / sizeof(fusedPairs[0]))
+
+static unsigned char fusedOpCode(unsigned char first, unsigned char second) {
+    for (int i = 0; i < FUSED_PAIR_COUNT; i++) {
+        if(fusedPairs[i][1] == first && fusedPairs[i][2] == second) {
+            return fusedPairs[i][0];
+        }
+    }
+    return first;
+}
+static void vmFuseInstructions(VM* vm) {
+    for (unsigned int i = 0; i + 1 < vm->programLength; i++) {
+        vm->program[i].op = fusedOpCode(vm->program[i].op, vm->program[i + 1].op);
+    }
+}
+
+//Superinstructions cost the sum of their parts, compiled code has the old costs baked in
+void vmSetCycleCost(VM* vm, OpCode op, unsigned char cycles) {
+    vm->cycleCosts[op] = cycles;
+    for (int i = 0; i < FUSED_PAIR_COUNT; i++) {
+        vm->cycleCosts[fusedPairs[i][0]] = vm->cycleCosts[fusedPairs[i][1]] + vm->cycleCosts[fusedPairs[i][2]];
+    }
+    //Native code has the costs baked in
+    jitDestroy(vm->jit);
+    vm->jit = NULL;
+}
+
+//The original opcode of a record, superinstructions are split up again when debugging
+unsigned char vmUnfusedOp(VM* vm, Instruction* ins) {
+    if(ins->op > BAD) {
+        return vm->code[ins->address];
+    }
+    return ins->op;
+}
+
 VM* vmLoadProgram(VM* vm, Chunk* chunk) {
+    free(vm->code);
+    free(vm->program);
+    free(vm->addressMap);
+    jitDestroy(vm->jit);
+    vm->jit = NULL;
+
     vm->code = malloc(chunk->size);
     vm->codeLength = chunk->size;
     for (int i = 0; i < chunk->size; i++) {
         vm->code[i] = chunk->data[i];
     }
+
+    //Decode the whole program once, every instruction is at least one byte
+    vm->program = malloc(sizeof(Instruction) * (vm->codeLength + 1));
+    vm->addressMap = malloc(sizeof(unsigned int) * (vm->codeLength + 1));
+    Decoder decoder = {vm->code, vm->codeLength, 0, DECODE_OK};
+    unsigned int count = 0;
+    while(decoder.ip < decoder.length) {
+        unsigned int start = decoder.ip;
+        vm->program[count] = decodeInstruction(&decoder);
+        for (unsigned int i = start; i < decoder.ip && i < decoder.length; i++) {
+            vm->addressMap[i] = NO_INSTRUCTION;
+        }
+        vm->addressMap[start] = count;
+        count++;
+    }
+
+    Instruction end = {END, 0, vm->codeLength, NO_INSTRUCTION};
+    vm->program[count] = end;
+    vm->programLength = count;
+    vm->program = realloc(vm->program, sizeof(Instruction) * (count + 1));
+
+    //Resolve immediate jump targets to instruction indices
+    for (unsigned int i = 0; i < count; i++) {
+        Instruction* ins = &vm->program[i];
+        if(isJump(ins->op) && ins->args[0].reg == ZERO_REGISTER) {
+            ins->target = vmResolveAddress(vm, ins->args[0].value);
+        }
+    }
+
+    vmFuseInstructions(vm);
     return vm;
 }
 
 void vmSysCall(VM* vm, int (*func)(VM* vm)) {
     vm->sysCalls[vm->sysCallCount] = func;
+    vm->sysCallRecorded[vm->sysCallCount] = false;
     vm->sysCallCount++;
 }
 
-int vmRun(VM* vm) {
-#define ERROR(msg) {vm->error = msg; vm->interrupt = true; return -1;}
+//For syscalls whose effects can't be reproduced by running them again, like reading input
+void vmSysCallRecorded(VM* vm, int (*func)(VM* vm)) {
+    vmSysCall(vm, func);
+    vm->sysCallRecorded[vm->sysCallCount - 1] = true;
+}
+
+static unsigned int vmJumpTarget(VM* vm, Instruction* ins) {
+    if(ins->args[0].reg == ZERO_REGISTER) {
+        return ins->target;
+    }
+    return vmResolveAddress(vm, vm->registers[ins->args[0].reg]);
+}
+
+//Direct threaded dispatch needs labels as values, everything else gets the switch
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED_DISPATCH
+#endif
+
+//Runs the interpreter from vm->ip. With a step budget it stops after that many instructions,
+//0 runs until the program finishes, is interrupted or fails.
+static VMStatus vmInterpret(VM* vm, unsigned long steps) {
+#define SETTLE() {vm->cycles += charged - budget; vm->budget -= charged - budget; charged = budget;}
+#define EXIT(status) {vm->ip = ins->address; SETTLE(); return status;}
+#define ERROR(msg) {vm->error = msg; vm->interrupt = true; EXIT(VM_ERROR);}
+#define ARG(i) ((short)(vm->registers[ins->args[i].reg] + ins->args[i].value))
+#define ADVANCE() {ins++; NEXT();}
+#define JUMP() {unsigned int target = vmJumpTarget(vm, ins); if(target == NO_INSTRUCTION) ERROR("Invalid jump target"); ins = program + target; NEXT();}
+#define CALL() {if(vm->cp >= 256) ERROR("Call stack overflow"); vm->callStack[vm->cp] = ins[1].address; vm->cp++; JUMP();}
+#define COMPARE(a, b) {vm->cmpFlags = (vm->cmpFlags & ~(CMP_EQUAL | CMP_LESS | CMP_GREATER)) | \
+        (a == b ? CMP_EQUAL : 0) | (a < b ? CMP_LESS : 0) | (a > b ? CMP_GREATER : 0);}
+#define COMPARE_AND(test, branch) {short a = ARG(0); short b = ARG(1); COMPARE(a, b); ins++; if(test) branch(); ADVANCE();}
+#define TRANSLATE(address) ((address) + vm->bankOffsets[(address) >> BANK_SHIFT])
+//Byte and word accesses. Fully allocated pages with the permission pass on the flags alone,
+//anything else (including a word that crosses into the bank window) gets the full check.
+#define CHECK_ACCESS(address, physical, length, access) { \
+        if((physical) > vm->memorySize - (length) || \
+           ((length) > 1 && ((address) & (BANK_SIZE - 1)) > BANK_SIZE - (length)) || \
+           (vm->pageFlags[(physical) >> PROTECT_PAGE_SHIFT] & vm->pageFlags[((physical) + (length) - 1) >> PROTECT_PAGE_SHIFT] & \
+            ((access) | PAGE_ALLOCATED)) != ((access) | PAGE_ALLOCATED)) { \
+            const char* fault = vmCheckAccess(vm, address, length, access); \
+            if(fault != NULL) ERROR(fault);}}
+//clip fills in drawn for a SCREEN_WIDTH x SCREEN_HEIGHT screen and pixels is charged from that, so headless
+//runs and replays pay the same. call draws to the screen, if there is one, and fills in drawn again.
+#define DRAW(clip, call, pixels) {Screen* screen = vm->buffers[vm->bp]; Rect drawn; \
+        if(clip) budget -= (pixels) / BULK_BYTES_PER_CYCLE; \
+        if(screen != NULL && (call)) screenTouch(screen, drawn, vm->generation);}
+#define FILL(x, y, width, height, pixels) DRAW(rectClip(SCREEN_WIDTH, SCREEN_HEIGHT, x, y, width, height, &drawn), \
+        screenFillRect(screen, x, y, width, height, vm->drawColor, &drawn), pixels)
+#define CHECK_RANGE(address, length, access) {const char* fault = vmCheckAccess(vm, address, length, access); \
+        if(fault != NULL) ERROR(fault);}
+#define STORE_BYTE() {unsigned short address = ARG(0) + ARG(1); \
+        unsigned int physical = TRANSLATE(address); \
+        CHECK_ACCESS(address, physical, 1, PAGE_WRITE); \
+        vm->memory[physical] = (unsigned char)ARG(2); \
+        vm->pageVersions[physical >> MEMORY_PAGE_SHIFT] = vm->generation;}
+#ifdef VM_THREADED_DISPATCH
+#define OPCODE(name) op_##name:
+#define NEXT() {if(budget <= 0) goto pause; budget -= costs[ins->op]; goto *table[ins->op];}
+#else
+#define OPCODE(name) case name:
+#define NEXT() break
+#endif
 
     vm->interrupt = false;
-    while(!vm->interrupt && vm->ip < vm->codeLength) {
-        if(vm->debugger != NULL)
+    if(vm->program == NULL) {
+        return VM_FINISHED;
+    }
+
+    Instruction* program = vm->program;
+    unsigned int start = vmResolveAddress(vm, vm->ip);
+    if(start == NO_INSTRUCTION) {
+        vm->error = "Invalid jump target";
+        vm->interrupt = true;
+        return VM_ERROR;
+    }
+    Instruction* ins = program + start;
+    bool stepped = steps > 0;
+    bool slow = vm->debugger != NULL || stepped;
+    //Single steps are charged to the budget but never stopped by it
+    long long budget = stepped ? LLONG_MAX : vm->budget;
+    long long charged = budget;
+
+#ifdef VM_THREADED_DISPATCH
+    static void* dispatchTable[256] = {
+            [0 ... 255] = &&op_default,
+            [NOP] = &&op_NOP, [SYS] = &&op_SYS,
+            [MOV] = &&op_MOV, [ADD] = &&op_ADD, [SUB] = &&op_SUB, [MUL] = &&op_MUL, [DIV] = &&op_DIV,
+            [JMP] = &&op_JMP, [JEQ] = &&op_JEQ, [JNE] = &&op_JNE, [JLT] = &&op_JLT, [JGT] = &&op_JGT,
+            [BRN] = &&op_BRN, [BEQ] = &&op_BEQ, [BNE] = &&op_BNE, [BLT] = &&op_BLT, [BGT] = &&op_BGT,
+            [CMP] = &&op_CMP, [RET] = &&op_RET,
+            [ALC] = &&op_ALC, [FRE] = &&op_FRE, [STB] = &&op_STB, [LDB] = &&op_LDB,
+            [SPX] = &&op_SPX, [CLS] = &&op_CLS,
+            [STW] = &&op_STW, [LDW] = &&op_LDW, [CPY] = &&op_CPY, [FIL] = &&op_FIL, [BNK] = &&op_BNK,
+            [VLD] = &&op_VLD, [SPD] = &&op_SPD, [SPR] = &&op_SPR,
+            [COL] = &&op_COL, [PEN] = &&op_PEN, [HLN] = &&op_HLN, [LIN] = &&op_LIN, [REC] = &&op_REC, [BOX] = &&op_BOX,
+            [TIL] = &&op_TIL, [SCR] = &&op_SCR,
+            [WAI] = &&op_WAI, [INP] = &&op_INP,
+            [END] = &&op_END, [BAD] = &&op_BAD,
+            [CMP_JEQ] = &&op_CMP_JEQ, [CMP_JNE] = &&op_CMP_JNE, [CMP_JLT] = &&op_CMP_JLT, [CMP_JGT] = &&op_CMP_JGT,
+            [CMP_BEQ] = &&op_CMP_BEQ, [CMP_BNE] = &&op_CMP_BNE, [CMP_BLT] = &&op_CMP_BLT, [CMP_BGT] = &&op_CMP_BGT,
+            [MOV_ADD] = &&op_MOV_ADD, [STB_STB] = &&op_STB_STB,
+    };
+    //Debugging and step budgets route every opcode through op_slow first, so the normal path never checks for them
+    static void* slowTable[256] = {
+            [0 ... 255] = &&op_slow,
+    };
+    //op_slow charges the unfused opcode instead
+    static const unsigned short noCosts[256];
+    void** table = slow ? slowTable : dispatchTable;
+    const unsigned short* costs = slow ? noCosts : vm->cycleCosts;
+    NEXT();
+
+    op_slow:
+    if(ins->op != END) {
+        if(stepped) {
+            if(steps == 0)
+                goto pause;
+            steps--;
+        }
+        budget -= vm->cycleCosts[vmUnfusedOp(vm, ins)];
+        if(vm->debugger != NULL) {
+            vm->ip = ins->address;
             vm->debugger(vm);
-        OpCode op = vm->code[vm->ip];
+        }
+    }
+    goto *dispatchTable[vmUnfusedOp(vm, ins)];
+#else
+    for(;;) {
+        if(budget <= 0)
+            goto pause;
+        unsigned char op = ins->op;
+        if(slow && op != END) {
+            if(stepped) {
+                if(steps == 0)
+                    goto pause;
+                steps--;
+            }
+            if(vm->debugger != NULL) {
+                vm->ip = ins->address;
+                vm->debugger(vm);
+            }
+            op = vmUnfusedOp(vm, ins);
+        }
+        budget -= vm->cycleCosts[op];
         switch (op) {
-            case NOP: {
-                vm->ip++;
-                break;
-            }
-            case SYS: {
-                vm->ip++;
-                short sysCall = readShort(vm);
-                if(vm->sysCalls[sysCall](vm) != 0) {
+#endif
+            OPCODE(NOP) {
+                ADVANCE();
+            }
+            OPCODE(SYS) {
+                short sysCall = ARG(0);
+                if(sysCall < 0 || sysCall >= vm->sysCallCount)
+                    ERROR("Unknown system call");
+                vm->ip = ins->address;
+                SETTLE();
+                int result = vm->recorder != NULL && vm->sysCallRecorded[sysCall] ?
+                        recorderSysCall(vm, sysCall) : vm->sysCalls[sysCall](vm);
+                if(result < 0)
+                    ERROR(vm->error != NULL ? vm->error : "System call failed");
+                if(result != 0) {
                     vm->interrupt = true;
                 }
-                vm->ip++;
-                break;
-            }
-            case MOV: {
-                vm->ip++;
-                if(vm->code[vm->ip] != REG)
-                    ERROR("Expected register");
-                vm->ip++;
-                unsigned char reg = vm->code[vm->ip];
-                vm->ip++;
-                short value = readShort(vm);
-                vm->registers[reg] = value;
-                vm->ip++;
-                break;
-            }
-            case ADD: {
-                vm->ip++;
-                if(vm->code[vm->ip] != REG)
-                    ERROR("Expected register");
-                vm->ip++;
-                unsigned char reg = vm->code[vm->ip];
-                vm->ip++;
-                short a = readShort(vm);
-                vm->ip++;
-                short b = readShort(vm);
-                vm->registers[reg] = a + b;
-                vm->ip++;
-                break;
-            }
-            case SUB: {
-                vm->ip++;
-                if(vm->code[vm->ip] != REG)
-                    ERROR("Expected register");
-                vm->ip++;
-                unsigned char reg = vm->code[vm->ip];
-                vm->ip++;
-                short a = readShort(vm);
-                vm->ip++;
-                short b = readShort(vm);
-                vm->registers[reg] = a - b;
-                vm->ip++;
-                break;
-            }
-            case MUL: {
-                vm->ip++;
-                if(vm->code[vm->ip] != REG)
-                    ERROR("Expected register");
-                vm->ip++;
-                unsigned char reg = vm->code[vm->ip];
-                vm->ip++;
-                short a = readShort(vm);
-                vm->ip++;
-                short b = readShort(vm);
-                vm->registers[reg] = a * b;
-                vm->ip++;
-                break;
-            }
-            case DIV: {
-                vm->ip++;
-                if(vm->code[vm->ip] != REG)
-                    ERROR("Expected register");
-                vm->ip++;
-                unsigned char reg = vm->code[vm->ip];
-                vm->ip++;
-                short a = readShort(vm);
-                vm->ip++;
-                short b = readShort(vm);
+                ins++;
+                //Syscalls are the only way to interrupt the program
+                if(vm->interrupt)
+                    EXIT(VM_INTERRUPTED);
+                NEXT();
+            }
+            OPCODE(MOV) {
+                vm->registers[ins->dst] = ARG(0);
+                ADVANCE();
+            }
+            OPCODE(ADD) {
+                vm->registers[ins->dst] = ARG(0) + ARG(1);
+                ADVANCE();
+            }
+            OPCODE(SUB) {
+                vm->registers[ins->dst] = ARG(0) - ARG(1);
+                ADVANCE();
+            }
+            OPCODE(MUL) {
+                vm->registers[ins->dst] = ARG(0) * ARG(1);
+                ADVANCE();
+            }
+            OPCODE(DIV) {
+                short b = ARG(1);
                 if(b == 0)
                     ERROR("Division by zero");
-                vm->registers[reg] = a / b;
-                vm->ip++;
-                break;
-            }
-            case BRN: {
-                vm->ip++;
-                short jumpLocation = readShort(vm);
-
-                vm->callStack[vm->cp] = vm->ip + 1;
-                vm->cp++;
-
-                vm->ip = jumpLocation;
-                break;
-            }
-            case BEQ: {
-                vm->ip++;
-                short jumpLocation = readShort(vm);
-                if(vm->cmpFlags & CMP_EQUAL) {
-                    vm->callStack[vm->cp] = vm->ip + 1;
-                    vm->cp++;
-
-                    vm->ip = jumpLocation;
-                } else {
-                    vm->ip++;
-                }
-                break;
-            }
-            case BNE: {
-                vm->ip++;
-                short jumpLocation = readShort(vm);
-                if(!(vm->cmpFlags & CMP_EQUAL)) {
-                    vm->callStack[vm->cp] = vm->ip + 1;
-                    vm->cp++;
-
-                    vm->ip = jumpLocation;
-                } else {
-                    vm->ip++;
-                }
-                break;
-            }
-            case BLT: {
-                vm->ip++;
-                short jumpLocation = readShort(vm);
-                if(vm->cmpFlags & CMP_LESS) {
-                    vm->callStack[vm->cp] = vm->ip + 1;
-                    vm->cp++;
-
-                    vm->ip = jumpLocation;
-                } else {
-                    vm->ip++;
-                }
-                break;
-            }
-            case BGT: {
-                vm->ip++;
-                short jumpLocation = readShort(vm);
-                if(vm->cmpFlags & CMP_GREATER) {
-                    //add to call stack
-                    vm->callStack[vm->cp] = vm->ip + 1;
-                    vm->cp++;
-
-                    vm->ip = jumpLocation;
-                } else {
-                    vm->ip++;
-                }
-                break;
-            }
-            case JMP: {
-                vm->ip++;
-                short jumpLocation = readShort(vm);
-                vm->ip = jumpLocation;
-                break;
-            }
-            case JEQ: {
-                vm->ip++;
-                short jumpLocation = readShort(vm);
-                if(vm->cmpFlags & CMP_EQUAL) {
-                    vm->ip = jumpLocation;
-                } else {
-                    vm->ip++;
-                }
-                break;
-            }
-            case JNE: {
-                vm->ip++;
-                short jumpLocation = readShort(vm);
-                if(!(vm->cmpFlags & CMP_EQUAL)) {
-                    vm->ip = jumpLocation;
-                } else {
-                    vm->ip++;
-                }
-                break;
-            }
-            case JLT: {
-                vm->ip++;
-                short jumpLocation = readShort(vm);
-                if(vm->cmpFlags & CMP_LESS) {
-                    vm->ip = jumpLocation;
-                } else {
-                    vm->ip++;
-                }
-                break;
-            }
-            case JGT: {
-                vm->ip++;
-                short jumpLocation = readShort(vm);
-                if(vm->cmpFlags & CMP_GREATER) {
-                    vm->ip = jumpLocation;
-                } else {
-                    vm->ip++;
-                }
-                break;
-            }
-            case CMP: {
-                vm->ip++;
-                short a = readShort(vm);
-                vm->ip++;
-                short b = readShort(vm);
-                if(a == b) {
-                    vm->cmpFlags |= CMP_EQUAL;
-                } else {
-                    vm->cmpFlags &= ~CMP_EQUAL;
-                }
-                if(a < b) {
-                    vm->cmpFlags |= CMP_LESS;
-                } else {
-                    vm->cmpFlags &= ~CMP_LESS;
-                }
-                if(a > b) {
-                    vm->cmpFlags |= CMP_GREATER;
-                } else {
-                    vm->cmpFlags &= ~CMP_GREATER;
-                }
-                vm->ip++;
-                break;
+                vm->registers[ins->dst] = ARG(0) / b;
+                ADVANCE();
+            }
+            OPCODE(BRN) {
+                CALL();
+            }
+            OPCODE(BEQ) {
+                if(vm->cmpFlags & CMP_EQUAL)
+                    CALL();
+                ADVANCE();
+            }
+            OPCODE(BNE) {
+                if(!(vm->cmpFlags & CMP_EQUAL))
+                    CALL();
+                ADVANCE();
+            }
+            OPCODE(BLT) {
+                if(vm->cmpFlags & CMP_LESS)
+                    CALL();
+                ADVANCE();
+            }
+            OPCODE(BGT) {
+                if(vm->cmpFlags & CMP_GREATER)
+                    CALL();
+                ADVANCE();
+            }
+            OPCODE(JMP) {
+                JUMP();
+            }
+            OPCODE(JEQ) {
+                if(vm->cmpFlags & CMP_EQUAL)
+                    JUMP();
+                ADVANCE();
+            }
+            OPCODE(JNE) {
+                if(!(vm->cmpFlags & CMP_EQUAL))
+                    JUMP();
+                ADVANCE();
             }
-            case RET: {
-                vm->ip = vm->callStack[vm->cp - 1];
+            OPCODE(JLT) {
+                if(vm->cmpFlags & CMP_LESS)
+                    JUMP();
+                ADVANCE();
+            }
+            OPCODE(JGT) {
+                if(vm->cmpFlags & CMP_GREATER)
+                    JUMP();
+                ADVANCE();
+            }
+            OPCODE(CMP) {
+                short a = ARG(0);
+                short b = ARG(1);
+                COMPARE(a, b);
+                ADVANCE();
+            }
+            OPCODE(RET) {
+                if(vm->cp == 0)
+                    ERROR("Call stack underflow");
                 vm->cp--;
-                break;
-            }
-            case ALC: {
-                vm->ip++;
-                if(vm->code[vm->ip] != REG)
-                    ERROR("Expected Register value");
-                vm->ip++;
-                int reg = vm->code[vm->ip];
-                vm->ip++;
-
-                short size = readShort(vm);
-                short ptr = vmAlloc(vm, size);
+                ins = program + vmResolveAddress(vm, vm->callStack[vm->cp]);
+                NEXT();
+            }
+            OPCODE(ALC) {
+                unsigned short size = ARG(0);
+                vm->ip = ins->address;
+                int ptr = vmAlloc(vm, size);
                 if(ptr == -1) {
                     ERROR("Out of memory");
                 }
-                vm->registers[reg] = (short)ptr;
-                vm->ip++;
-                break;
-            }
-            case FRE: {
-                vm->ip++;
-                short ptr = readShort(vm);
-                vm->ip++;
-                vmFree(vm, ptr);
-                break;
-            }
-            case STB: {
-                vm->ip++;
-                short ptr = readShort(vm);
-                vm->ip++;
-                short offset = readShort(vm);
-                vm->ip++;
-                short value = readShort(vm);
-                if(vm->memoryMap[ptr + offset] == false) {
-                    ERROR("Memory not allocated");
+                vm->registers[ins->dst] = (unsigned short)ptr;
+                ADVANCE();
+            }
+            OPCODE(FRE) {
+                FreeResult result = vmFree(vm, ARG(0));
+                if(result == FREE_DOUBLE) {
+                    ERROR("Double free");
                 }
-                vm->memory[ptr + offset] = (unsigned char)value;
-                vm->ip++;
-                break;
-            }
-            case LDB: {
-                vm->ip++;
-                short ptr = readShort(vm);
-                vm->ip++;
-                short offset = readShort(vm);
-                vm->ip++;
-                if(vm->code[vm->ip] != REG)
-                    ERROR("Expected register");
-                vm->ip++;
-                unsigned char reg = vm->code[vm->ip];
-                if(vm->memoryMap[ptr + offset] == false) {
-                    ERROR("Memory not allocated");
+                if(result == FREE_INVALID) {
+                    ERROR("Invalid free");
                 }
-                vm->registers[reg] = vm->memory[ptr + offset];
-                vm->ip++;
-                break;
+                ADVANCE();
+            }
+            OPCODE(STB) {
+                STORE_BYTE();
+                ADVANCE();
+            }
+            OPCODE(LDB) {
+                unsigned short address = ARG(0) + ARG(1);
+                unsigned int physical = TRANSLATE(address);
+                CHECK_ACCESS(address, physical, 1, PAGE_READ);
+                vm->registers[ins->dst] = vm->memory[physical];
+                ADVANCE();
             }
             //Extended opcodes
-            case SPX: {
-                vm->ip++;
-                short x = readShort(vm);
-                vm->ip++;
-                short y = readShort(vm);
-                vm->ip++;
-                short color = readShort(vm);
-                vm->buffers[vm->bp]->buffer[y * vm->buffers[vm->bp]->width + x] = (unsigned char)color;
-                vm->ip++;
-                break;
-            }
-            case CLS: {
-                vm->ip++;
-                short color = readShort(vm);
-                for (int i = 0; i < vm->buffers[vm->bp]->width * vm->buffers[vm->bp]->height; i++) {
-                    vm->buffers[vm->bp]->buffer[i] = (unsigned char)color;
+            OPCODE(SPX) {
+                short x = ARG(0);
+                short y = ARG(1);
+                Screen* screen = vm->buffers[vm->bp];
+                if(screen != NULL && x >= 0 && x < screen->width && y >= 0 && y < screen->height) {
+                    int pixel = y * screen->width + x;
+                    screen->buffer[pixel] = (unsigned char)ARG(2);
+                    screen->pageVersions[pixel >> SCREEN_PAGE_SHIFT] = vm->generation;
+                    Span* dirty = &screen->dirty[y];
+                    if(dirty->left >= dirty->right) {
+                        *dirty = (Span){x, (short)(x + 1)};
+                    } else if(x < dirty->left) {
+                        dirty->left = x;
+                    } else if(x >= dirty->right) {
+                        dirty->right = (short)(x + 1);
+                    }
+                }
+                ADVANCE();
+            }
+            OPCODE(CLS) {
+                short color = ARG(0);
+                Screen* screen = vm->buffers[vm->bp];
+                Tilemap* tilemap = &vm->tilemap;
+                if(tilemap->width > 0) {
+                    budget -= SCREEN_WIDTH * SCREEN_HEIGHT / BULK_BYTES_PER_CYCLE;
                 }
-                vm->ip++;
-                break;
+                if(screen != NULL) {
+                    if(tilemap->width > 0) {
+                        screenDrawTiles(screen, vm->videoMemory + tilemap->tileset, vm->videoMemory + tilemap->map,
+                                        tilemap->width, tilemap->height, tilemap->scrollX, tilemap->scrollY);
+                    } else {
+                        memset(screen->buffer, (unsigned char)color, screen->width * screen->height);
+                    }
+                    for (int i = 0; i < screenPageCount(screen); i++) {
+                        screen->pageVersions[i] = vm->generation;
+                    }
+                    screenMarkAllDirty(screen);
+                }
+                ADVANCE();
             }
 
-            default: {
-                vm->interrupt = true;
-                vm->error = "Unknown opcode";
-                return -1;
+            //Bulk memory
+            OPCODE(STW) {
+                unsigned short address = ARG(0) + ARG(1);
+                unsigned int physical = TRANSLATE(address);
+                CHECK_ACCESS(address, physical, 2, PAGE_WRITE);
+                unsigned short value = ARG(2);
+                vm->memory[physical] = value & 0xFF;
+                vm->memory[physical + 1] = value >> 8;
+                vm->pageVersions[physical >> MEMORY_PAGE_SHIFT] = vm->generation;
+                vm->pageVersions[(physical + 1) >> MEMORY_PAGE_SHIFT] = vm->generation;
+                ADVANCE();
             }
-        }
-    }
-    //Make sure that all memory is freed before exiting
-    for (int i = 0; i < 16000; i++) {
-        if(vm->memoryMap[i]) {
-            printf("Memory leak at %d\n    size %d\n", i, vm->memorySizes[i]);
-            while(vm->memoryMap[i]) {
-                i++;
+            OPCODE(LDW) {
+                unsigned short address = ARG(0) + ARG(1);
+                unsigned int physical = TRANSLATE(address);
+                CHECK_ACCESS(address, physical, 2, PAGE_READ);
+                vm->registers[ins->dst] = vm->memory[physical] | vm->memory[physical + 1] << 8;
+                ADVANCE();
+            }
+            OPCODE(CPY) {
+                unsigned short to = ARG(0);
+                unsigned short from = ARG(1);
+                unsigned short length = ARG(2);
+                CHECK_RANGE(from, length, PAGE_READ);
+                CHECK_RANGE(to, length, PAGE_WRITE);
+                unsigned int physical = TRANSLATE(to);
+                memmove(vm->memory + physical, vm->memory + TRANSLATE(from), length);
+                vmTouchMemory(vm, physical, length);
+                budget -= length / BULK_BYTES_PER_CYCLE;
+                ADVANCE();
+            }
+            OPCODE(FIL) {
+                unsigned short ptr = ARG(0);
+                short value = ARG(1);
+                unsigned short length = ARG(2);
+                CHECK_RANGE(ptr, length, PAGE_WRITE);
+                unsigned int physical = TRANSLATE(ptr);
+                memset(vm->memory + physical, (unsigned char)value, length);
+                vmTouchMemory(vm, physical, length);
+                budget -= length / BULK_BYTES_PER_CYCLE;
+                ADVANCE();
+            }
+            OPCODE(BNK) {
+                if(!vmSetBank(vm, (unsigned short)ARG(0)))
+                    ERROR("Invalid bank");
+                ADVANCE();
+            }
+
+            //Sprites
+            OPCODE(VLD) {
+                unsigned short to = ARG(0);
+                unsigned short from = ARG(1);
+                unsigned short length = ARG(2);
+                CHECK_RANGE(from, length, PAGE_READ);
+                if(to + length > VIDEO_MEMORY_SIZE)
+                    ERROR("Video memory out of range");
+                memcpy(vm->videoMemory + to, vm->memory + TRANSLATE(from), length);
+                for (int page = to >> MEMORY_PAGE_SHIFT; length > 0 && page <= (to + length - 1) >> MEMORY_PAGE_SHIFT; page++) {
+                    vm->videoPageVersions[page] = vm->generation;
+                }
+                budget -= length / BULK_BYTES_PER_CYCLE;
+                ADVANCE();
+            }
+            OPCODE(SPD) {
+                unsigned short id = ARG(0);
+                unsigned short address = ARG(1);
+                if(id >= SPRITE_COUNT)
+                    ERROR("Invalid sprite");
+                CHECK_RANGE(address, 6, PAGE_READ);
+                unsigned char* descriptor = vm->memory + TRANSLATE(address);
+                Sprite sprite;
+                sprite.offset = descriptor[0] | descriptor[1] << 8;
+                sprite.width = descriptor[2];
+                sprite.height = descriptor[3];
+                sprite.key = descriptor[5] & 1 ? descriptor[4] : -1;
+                if(sprite.offset + sprite.width * sprite.height > VIDEO_MEMORY_SIZE)
+                    ERROR("Video memory out of range");
+                vm->sprites[id] = sprite;
+                ADVANCE();
+            }
+            OPCODE(SPR) {
+                short x = ARG(0);
+                short y = ARG(1);
+                unsigned short sprite = ARG(2); //Sprite in the low byte, BlitFlags above it
+                Sprite* image = &vm->sprites[sprite & 0xFF];
+                DRAW(rectClip(SCREEN_WIDTH, SCREEN_HEIGHT, x, y, image->width, image->height, &drawn),
+                     screenBlit(screen, vm->videoMemory + image->offset, image->width, image->height,
+                                x, y, image->key, sprite >> 8, &drawn),
+                     drawn.width * drawn.height);
+                ADVANCE();
+            }
+
+            //Drawing
+            OPCODE(COL) {
+                vm->drawColor = (unsigned char)ARG(0);
+                ADVANCE();
+            }
+            OPCODE(PEN) {
+                vm->penX = ARG(0);
+                vm->penY = ARG(1);
+                ADVANCE();
+            }
+            OPCODE(HLN) {
+                short x = ARG(0);
+                short y = ARG(1);
+                short length = ARG(2);
+                FILL(x, y, length, 1, drawn.width);
+                ADVANCE();
+            }
+            OPCODE(LIN) {
+                short x = ARG(0);
+                short y = ARG(1);
+                DRAW(lineClip(SCREEN_WIDTH, SCREEN_HEIGHT, vm->penX, vm->penY, x, y, &drawn),
+                     screenDrawLine(screen, vm->penX, vm->penY, x, y, vm->drawColor, &drawn),
+                     drawn.width > drawn.height ? drawn.width : drawn.height);
+                vm->penX = x;
+                vm->penY = y;
+                ADVANCE();
+            }
+            OPCODE(REC) {
+                short x = ARG(0);
+                short y = ARG(1);
+                int left = x < vm->penX ? x : vm->penX;
+                int top = y < vm->penY ? y : vm->penY;
+                int width = abs(x - vm->penX) + 1;
+                int height = abs(y - vm->penY) + 1;
+                FILL(left, top, width, height, drawn.width * drawn.height);
+                ADVANCE();
+            }
+            OPCODE(BOX) {
+                short x = ARG(0);
+                short y = ARG(1);
+                int left = x < vm->penX ? x : vm->penX;
+                int top = y < vm->penY ? y : vm->penY;
+                int width = abs(x - vm->penX) + 1;
+                int height = abs(y - vm->penY) + 1;
+                FILL(left, top, width, 1, drawn.width);
+                FILL(left, top + height - 1, width, 1, drawn.width);
+                FILL(left, top + 1, 1, height - 2, drawn.height);
+                FILL(left + width - 1, top + 1, 1, height - 2, drawn.height);
+                ADVANCE();
+            }
+
+            //Tilemap
+            OPCODE(TIL) {
+                unsigned short address = ARG(0);
+                CHECK_RANGE(address, 6, PAGE_READ);
+                unsigned char* descriptor = vm->memory + TRANSLATE(address);
+                Tilemap tilemap = vm->tilemap;
+                tilemap.tileset = descriptor[0] | descriptor[1] << 8;
+                tilemap.map = descriptor[2] | descriptor[3] << 8;
+                tilemap.width = descriptor[4];
+                tilemap.height = descriptor[5];
+                if(tilemap.width == 0 || tilemap.height == 0) {
+                    tilemap.width = 0;
+                } else if(tilemap.tileset + 256 * TILE_BYTES > VIDEO_MEMORY_SIZE ||
+                          tilemap.map + tilemap.width * tilemap.height > VIDEO_MEMORY_SIZE) {
+                    ERROR("Video memory out of range");
+                }
+                vm->tilemap = tilemap;
+                ADVANCE();
+            }
+            OPCODE(SCR) {
+                vm->tilemap.scrollX = ARG(0);
+                vm->tilemap.scrollY = ARG(1);
+                ADVANCE();
+            }
+
+            //Frame pacing, resumes after the WAI
+            OPCODE(WAI) {
+                ins++;
+                EXIT(VM_WAITING);
+            }
+
+            //Input
+            OPCODE(INP) {
+                unsigned short index = ARG(0);
+                vm->registers[ins->dst] = index < INPUT_REGISTER_COUNT ? vm->input[index] : 0;
+                ADVANCE();
+            }
+
+            //Superinstructions
+            OPCODE(CMP_JEQ) COMPARE_AND(a == b, JUMP)
+            OPCODE(CMP_JNE) COMPARE_AND(a != b, JUMP)
+            OPCODE(CMP_JLT) COMPARE_AND(a < b, JUMP)
+            OPCODE(CMP_JGT) COMPARE_AND(a > b, JUMP)
+            OPCODE(CMP_BEQ) COMPARE_AND(a == b, CALL)
+            OPCODE(CMP_BNE) COMPARE_AND(a != b, CALL)
+            OPCODE(CMP_BLT) COMPARE_AND(a < b, CALL)
+            OPCODE(CMP_BGT) COMPARE_AND(a > b, CALL)
+            OPCODE(MOV_ADD) {
+                vm->registers[ins->dst] = ARG(0);
+                ins++;
+                vm->registers[ins->dst] = ARG(0) + ARG(1);
+                ADVANCE();
             }
+            OPCODE(STB_STB) {
+                //Charged for both up front, a fault in the first store must not pay for the second
+                budget += vm->cycleCosts[STB];
+                STORE_BYTE();
+                budget -= vm->cycleCosts[STB];
+                ins++;
+                STORE_BYTE();
+                ADVANCE();
+            }
+
+            OPCODE(END) {
+                EXIT(VM_FINISHED);
+            }
+            OPCODE(BAD) {
+                ERROR(decodeErrors[ins->dst]);
+            }
+#ifdef VM_THREADED_DISPATCH
+            op_default:
+#else
+            default:
+#endif
+            {
+                ERROR("Unknown opcode");
+            }
+#ifndef VM_THREADED_DISPATCH
         }
     }
+#endif
+
+    pause:
+    EXIT(VM_RUNNING);
+#undef SETTLE
+#undef EXIT
+#undef ERROR
+#undef ARG
+#undef ADVANCE
+#undef JUMP
+#undef CALL
+#undef COMPARE
+#undef COMPARE_AND
+#undef TRANSLATE
+#undef CHECK_ACCESS
+#undef CHECK_RANGE
+#undef DRAW
+#undef FILL
+#undef STORE_BYTE
+#undef OPCODE
+#undef NEXT
+}
+
+static VMStatus vmExecute(VM* vm) {
+    if(vm->useJit && vm->debugger == NULL && jitPrepare(vm)) {
+        return jitRun(vm);
+    }
+    return vmInterpret(vm, 0);
+}
+
+//Runs to the end as fast as possible, WAI doesn't wait
+int vmRun(VM* vm) {
+    vm->budget = LLONG_MAX;
+    VMStatus status;
+    do {
+        status = vmExecute(vm);
+    } while (status == VM_WAITING);
+    if(status == VM_ERROR) {
+        return -1;
+    }
+
+    vmReportLeaks(vm);
     return vm->registers[0];
 }
 
-short readShort(VM* vm) {
-    unsigned char low = vm->code[vm->ip];
-    switch(low) {
-        case IMS:
-        {
-            vm->ip++;
-            unsigned char a = vm->code[vm->ip];
-            vm->ip++;
-            unsigned char b = vm->code[vm->ip];
-            return (b << 8) | a;
-        }
-        case IMB:
-        {
-            vm->ip++;
-            unsigned char a = vm->code[vm->ip];
-            return a;
-        }
-        case REG:
-        {
-            vm->ip++;
-            unsigned char reg = vm->code[vm->ip];
-            return vm->registers[reg];
-        }
-        default:
-            return low;
+//Runs until about `cycles` emulated cycles are spent. The last instruction may overshoot,
+//budget is left negative by that much. VM_RUNNING and VM_WAITING mean it can be resumed with another call.
+VMStatus vmRunFor(VM* vm, long long cycles) {
+    vm->budget = cycles;
+    VMStatus status = vmExecute(vm);
+    if(status == VM_FINISHED || status == VM_INTERRUPTED) {
+        vmReportLeaks(vm);
     }
+    return status;
 }
 
-short vmAlloc(VM* vm, int size) {
-    short ptr = -1;
-    for (int i = 0; i < 16000; i++) {
-        if(!vm->memoryMap[i]) {
-            bool usable = true;
-            for (int j = 0; j < size; j++) {
-                if(vm->memoryMap[i + j]) {
-                    usable = false;
-                    break;
-                }
-            }
-            if(usable) {
-                ptr = (short)i;
-                for (int j = 0; j < size; j++) {
-                    vm->memoryMap[i + j] = true;
-                }
-                vm->memorySizes[i] = size;
-                break;
-            }
-        }
+VMStatus vmStep(VM* vm) {
+    return vmInterpret(vm, 1);
+}
+
+//Syscalls that write guest memory have to call this, or snapshots miss the change
+void vmTouchMemory(VM* vm, unsigned int address, unsigned int length) {
+    if(length == 0) {
+        return;
     }
-    if(ptr == -1) {
-        return -1;
+    unsigned int last = (address + length - 1) >> MEMORY_PAGE_SHIFT;
+    for (unsigned int page = address >> MEMORY_PAGE_SHIFT; page <= last && page < vm->memoryPages; page++) {
+        vm->pageVersions[page] = vm->generation;
     }
-    return ptr;
 }
 
-void vmFree(VM* vm, short ptr) {
-    int offset = ptr;
-    int size = vm->memorySizes[offset];
-    if(size == 0) {
+//Host memory a program may only read (or not touch at all). Whole pages change, so protect
+//memory the host allocated itself and keep it page aligned.
+void vmProtect(VM* vm, unsigned int address, unsigned int length, unsigned char access) {
+    if(length == 0) {
         return;
     }
-    for (int i = 0; i < size; i++) {
-        vm->memoryMap[offset + i] = false;
+    unsigned int pages = (vm->memorySize + (1 << PROTECT_PAGE_SHIFT) - 1) >> PROTECT_PAGE_SHIFT;
+    unsigned int last = (address + length - 1) >> PROTECT_PAGE_SHIFT;
+    for (unsigned int page = address >> PROTECT_PAGE_SHIFT; page <= last && page < pages; page++) {
+        vm->pageFlags[page] = (vm->pageFlags[page] & PAGE_ALLOCATED) | (access & (PAGE_READ | PAGE_WRITE));
+    }
+}
+
+unsigned int vmTranslate(VM* vm, unsigned short address) {
+    return address + vm->bankOffsets[address >> BANK_SHIFT];
+}
+
+//Bank 0 is always there, even when all of memory fits below the window
+bool vmSetBank(VM* vm, unsigned int bank) {
+    if(bank > 0 && bank >= vm->bankCount) {
+        return false;
+    }
+    vm->bank = (unsigned short)bank;
+    vm->bankOffsets[BANK_WINDOW >> BANK_SHIFT] = bank * BANK_SIZE;
+    return true;
+}
+
+//Returns why the program may not access the range, NULL when it may
+const char* vmCheckAccess(VM* vm, unsigned short address, int length, unsigned char access) {
+    if(length < 0 || address + length > 0x10000) {
+        return "Memory access out of range";
+    }
+    if(length == 0) {
+        return NULL;
     }
-}
\ No newline at end of file
+    unsigned int start = vmTranslate(vm, address);
+    unsigned int last = vmTranslate(vm, address + length - 1);
+    if(last - start != (unsigned int)length - 1) {
+        return "Memory access crosses into the bank window";
+    }
+    if(last >= vm->memorySize) {
+        return "Memory access out of range";
+    }
+
+    unsigned int end = start + length;
+    for (unsigned int page = start >> PROTECT_PAGE_SHIFT; page << PROTECT_PAGE_SHIFT < end; page++) {
+        unsigned char flags = vm->pageFlags[page];
+        if((flags & access) != access) {
+            if(!(flags & (PAGE_READ | PAGE_WRITE)))
+                return "Memory not mapped";
+            return access & PAGE_WRITE ? "Memory is read only" : "Memory is write only";
+        }
+        if(!(flags & PAGE_ALLOCATED)) {
+            unsigned int from = page << PROTECT_PAGE_SHIFT;
+            unsigned int to = (page + 1) << PROTECT_PAGE_SHIFT;
+            from = from < start ? start : from;
+            to = to > end ? end : to;
+            if(memchr(vm->memoryMap + from, false, to - from) != NULL) {
+                return "Memory not allocated";
+            }
+        }
+    }
+    return NULL;
+}
+
+//Loads a file into video memory, for sprites that aren't part of the program.
+//Call it before running, loading isn't part of snapshots or recordings.
+bool vmLoadVideoFile(VM* vm, const char* path, unsigned int offset) {
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) {
+        return false;
+    }
+    size_t length = offset < VIDEO_MEMORY_SIZE ? fread(vm->videoMemory + offset, 1, VIDEO_MEMORY_SIZE - offset, file) : 0;
+    fclose(file);
+    for (unsigned int page = offset >> MEMORY_PAGE_SHIFT; length > 0 && page <= (offset + length - 1) >> MEMORY_PAGE_SHIFT; page++) {
+        vm->videoPageVersions[page] = vm->generation;
+    }
+    return true;
+}
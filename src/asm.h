@@ -5,17 +5,133 @@
 #include "rendering.h"
 #include "ops.h"
 #include "chunk.h"
+#include "input.h"
+
+#define REGISTER_COUNT 16
+#define ZERO_REGISTER REGISTER_COUNT //Always 0, decoded immediates read from it
+#define NO_INSTRUCTION 0xFFFFFFFF
+
+#define MEMORY_SIZE 16000 //Physical memory of vmCreate
+#define MEMORY_PAGE_SHIFT 8 //Snapshots track changes in 256 byte pages
+#define PROTECT_PAGE_SHIFT 6 //Access permissions are kept for 64 byte pages
+
+//Guest addresses are unsigned 16 bit. Everything below BANK_WINDOW maps straight to physical
+//memory and is what ALC hands out, the window above it shows one bank of the memory past that.
+#define BANK_SHIFT 14
+#define BANK_SIZE (1 << BANK_SHIFT)
+#define BANK_WINDOW 0xC000
+#define MIN_MEMORY_SIZE (1 << MEMORY_PAGE_SHIFT)
+#define MAX_MEMORY_SIZE (BANK_WINDOW + 1024 * BANK_SIZE)
+
+#define VIDEO_MEMORY_SIZE 0x10000
+#define VIDEO_PAGES (VIDEO_MEMORY_SIZE >> MEMORY_PAGE_SHIFT)
+#define SPRITE_COUNT 256
+//What programs draw on, drawing is charged for this size even without a screen attached
+#define SCREEN_WIDTH 400
+#define SCREEN_HEIGHT 300
+
+//Internal opcodes, only produced by the decoder
+typedef enum {
+    END = 128, //Past the end of the program
+    BAD, //Malformed instruction, dst indexes the error message
+
+    //Superinstructions, run this record and the next one in a single dispatch
+    CMP_JEQ,
+    CMP_JNE,
+    CMP_JLT,
+    CMP_JGT,
+    CMP_BEQ,
+    CMP_BNE,
+    CMP_BLT,
+    CMP_BGT,
+    MOV_ADD,
+    STB_STB,
+} DecodedOpCode;
+
+typedef struct {
+    unsigned char reg; //Source register, ZERO_REGISTER for immediates
+    unsigned short value; //Immediate value, 0 for registers
+} Operand;
+
+typedef struct {
+    unsigned char op;
+    unsigned char dst; //Destination register
+    unsigned short address; //Byte address in code
+    unsigned int target; //Instruction index of an immediate jump target
+    Operand args[3];
+} Instruction;
+
+typedef enum {
+    VM_RUNNING, //Stopped on the step or cycle budget, can be resumed
+    VM_WAITING, //Stopped on WAI, the host resumes it on the next frame or on input
+    VM_FINISHED,
+    VM_INTERRUPTED,
+    VM_ERROR,
+} VMStatus;
+
+//Permissions of a protection page, every guest memory access checks them
+typedef enum {
+    PAGE_UNMAPPED = 0,
+    PAGE_READ = 1,
+    PAGE_WRITE = 2,
+    PAGE_ALLOCATED = 4, //Every byte is allocated, accesses don't have to look at memoryMap
+} PageFlags;
+
+typedef enum {
+    FREE_OK,
+    FREE_DOUBLE, //The allocation there was freed already
+    FREE_INVALID, //Not the start of an allocation and never was one
+} FreeResult;
+
+//An image in video memory, stored row by row. SPD reads it from a 6 byte descriptor:
+//offset (2 bytes), width, height, key, flags. Flags bit 0 makes the key color transparent.
+typedef struct {
+    unsigned short offset;
+    unsigned char width, height;
+    short key; //-1 when every pixel is drawn
+} Sprite;
+
+//Background layer CLS draws instead of a plain color while width is set. TIL reads it from a
+//6 byte descriptor: tileset offset (2 bytes), map offset (2 bytes), width, height.
+typedef struct {
+    unsigned short tileset; //256 tiles of TILE_BYTES each, in video memory
+    unsigned short map; //One tile index per tile, row by row, in video memory
+    unsigned char width, height; //In tiles, 0 when there is no tilemap
+    short scrollX, scrollY;
+} Tilemap;
 
 struct VM{
+    //Physical memory, guest addresses go through bankOffsets first
     unsigned char* memory;
+    unsigned int memorySize;
+    unsigned int heapSize; //Memory below BANK_WINDOW
     bool* memoryMap;
-    unsigned short* memorySizes;
-    unsigned short registers[16];
+    unsigned short* memorySizes; //Only covers the heap, see heap.h for what free addresses hold
+    struct Heap* heap; //Allocator state, see heap.h
+    unsigned char* pageFlags; //PageFlags of each protection page
+
+    unsigned short bank;
+    unsigned int bankCount;
+    unsigned int bankOffsets[4]; //Added to a guest address to get the physical one, by address >> BANK_SHIFT
+
+    unsigned short registers[REGISTER_COUNT + 1];
+
+    //Snapshot generation each memory page last changed in, see snapshot.h
+    unsigned int generation;
+    unsigned int memoryPages;
+    unsigned int* pageVersions;
 
     //Rendering
     unsigned char* videoMemory; //For sprites and such
+    unsigned int videoPageVersions[VIDEO_PAGES]; //Like pageVersions
+    Sprite sprites[SPRITE_COUNT];
+    unsigned char drawColor;
+    short penX, penY;
+    Tilemap tilemap;
     unsigned short bp;
-    Screen* buffers[2]; //For the actual screen
+    Screen* buffers[2]; //For the actual screen, NULL when headless
+
+    unsigned short input[INPUT_REGISTER_COUNT]; //Latched by the host, see input.h
 
     unsigned short sp;
     unsigned short stack[256];
@@ -27,13 +143,31 @@ struct VM{
     unsigned int codeLength;
     unsigned char* code;
 
+    //Decoded once by vmLoadProgram, program[programLength] is always END
+    Instruction* program;
+    unsigned int programLength;
+    unsigned int* addressMap; //Byte address -> instruction index
+
+    //Native code, only used when useJit is set
+    bool useJit;
+    struct Jit* jit;
+
     unsigned char cmpFlags;
 
+    //Emulated CPU time, indexed by decoded opcode so superinstructions cost both halves
+    unsigned short cycleCosts[256];
+    unsigned long long cycles; //Total cycles executed
+    long long budget; //Cycles left before vmRunFor pauses
+
     int sysCallCount;
     int (*sysCalls[256])(struct VM* vm);
+    bool sysCallRecorded[256]; //Depends on the outside world, see record.h
+    struct Recorder* recorder; //Records or replays the recorded syscalls, NULL otherwise
 
     void (*debugger)(struct VM* vm);
 
+    void* host; //Host state for syscalls, so nothing has to be global
+
     bool interrupt;
     const char* error;
 };
@@ -41,11 +175,27 @@ struct VM{
 typedef struct VM VM;
 
 VM* vmCreate();
+VM* vmCreateWithMemory(unsigned int memorySize);
+void vmDestroy(VM* vm);
 VM* vmLoadProgram(VM* vm, Chunk* chunk);
+//A syscall returns nonzero to stop the program, or sets vm->error and returns -1 to fail it
 void vmSysCall(VM* vm, int (*func)(VM* vm));
+void vmSysCallRecorded(VM* vm, int (*func)(VM* vm));
 int vmRun(VM* vm);
-short readShort(VM* vm);
-short vmAlloc(VM* vm, int size);
-void vmFree(VM* vm, short ptr);
+VMStatus vmRunFor(VM* vm, long long cycles);
+VMStatus vmStep(VM* vm);
+void vmSetCycleCost(VM* vm, OpCode op, unsigned char cycles);
+unsigned int vmResolveAddress(VM* vm, unsigned short address);
+unsigned char vmUnfusedOp(VM* vm, Instruction* ins);
+//Guest addresses
+unsigned int vmTranslate(VM* vm, unsigned short address);
+const char* vmCheckAccess(VM* vm, unsigned short address, int length, unsigned char access);
+bool vmSetBank(VM* vm, unsigned int bank);
+bool vmLoadVideoFile(VM* vm, const char* path, unsigned int offset);
+int vmAlloc(VM* vm, int size);
+FreeResult vmFree(VM* vm, unsigned short ptr);
+//Physical addresses
+void vmTouchMemory(VM* vm, unsigned int address, unsigned int length);
+void vmProtect(VM* vm, unsigned int address, unsigned int length, unsigned char access);
 
 #endif //FAKEOS_ASM_H
@@ -1,10 +1,15 @@
 #include "chunk.h"
 
 Chunk* chunkCreate() {
+    return chunkCreateWithCapacity(1);
+}
+
+//Writing up to capacity - 1 bytes never reallocates
+Chunk* chunkCreateWithCapacity(int capacity) {
     Chunk* chunk = malloc(sizeof(Chunk));
-    chunk->data = malloc(1);
+    chunk->data = malloc(capacity > 0 ? capacity : 1);
     chunk->size = 0;
-    chunk->capacity = 1;
+    chunk->capacity = capacity > 0 ? capacity : 1;
     return chunk;
 }
 
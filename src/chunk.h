@@ -11,6 +11,7 @@ typedef struct {
 } Chunk;
 
 Chunk* chunkCreate();
+Chunk* chunkCreateWithCapacity(int capacity);
 void chunkWriteByte(Chunk* chunk, unsigned char data);
 void chunkDestroy(Chunk* chunk);
 
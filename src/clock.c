@@ -0,0 +1,50 @@
+#include <time.h>
+#include "clock.h"
+#include "telemetry.h"
+
+void frameClockInit(FrameClock* clock, unsigned long long period) {
+    clock->period = period;
+    clock->next = telemetryNow() + period;
+    pthread_mutex_init(&clock->lock, NULL);
+    pthread_cond_init(&clock->wake, NULL);
+    clock->woken = false;
+}
+
+void frameClockDestroy(FrameClock* clock) {
+    pthread_cond_destroy(&clock->wake);
+    pthread_mutex_destroy(&clock->lock);
+}
+
+unsigned long long frameClockWait(FrameClock* clock) {
+    unsigned long long start = telemetryNow();
+    if(start >= clock->next) {
+        clock->next += ((start - clock->next) / clock->period + 1) * clock->period;
+    }
+
+    pthread_mutex_lock(&clock->lock);
+    unsigned long long now = start;
+    while(!clock->woken && now < clock->next) {
+        //Timed waits take wall clock time, the deadline is only converted right before waiting
+        struct timespec deadline;
+        timespec_get(&deadline, TIME_UTC);
+        unsigned long long nanoseconds = deadline.tv_nsec + (clock->next - now);
+        deadline.tv_sec += (time_t)(nanoseconds / 1000000000ull);
+        deadline.tv_nsec = (long)(nanoseconds % 1000000000ull);
+        pthread_cond_timedwait(&clock->wake, &clock->lock, &deadline);
+        now = telemetryNow();
+    }
+    clock->woken = false;
+    pthread_mutex_unlock(&clock->lock);
+
+    if(now >= clock->next) {
+        clock->next += clock->period;
+    }
+    return now - start;
+}
+
+void frameClockWake(FrameClock* clock) {
+    pthread_mutex_lock(&clock->lock);
+    clock->woken = true;
+    pthread_cond_signal(&clock->wake);
+    pthread_mutex_unlock(&clock->lock);
+}
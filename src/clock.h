@@ -0,0 +1,27 @@
+#ifndef FAKEOS_CLOCK_H
+#define FAKEOS_CLOCK_H
+#include <stdbool.h>
+#include <pthread.h>
+
+#define FRAME_PERIOD 16666667ull //Nanoseconds, 60 Hz
+
+//Ticks at a fixed rate for guests waiting on WAI. The VM thread sleeps in frameClockWait, any
+//other thread can wake it early. A wake while nobody waits isn't lost, the next wait returns at once.
+typedef struct {
+    unsigned long long period; //Nanoseconds between ticks
+    unsigned long long next; //Next tick, on the telemetryNow clock
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool woken;
+} FrameClock;
+
+void frameClockInit(FrameClock* clock, unsigned long long period);
+void frameClockDestroy(FrameClock* clock);
+//Sleeps until the next tick or a wake and returns the nanoseconds slept. Returns early when
+//woken, otherwise the clock moves on to the tick after that one. Ticks that passed while the
+//guest ran are skipped rather than caught up on.
+unsigned long long frameClockWait(FrameClock* clock);
+void frameClockWake(FrameClock* clock);
+
+#endif //FAKEOS_CLOCK_H
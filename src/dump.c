@@ -0,0 +1,73 @@
+#include <string.h>
+#include "dump.h"
+
+bool frameDumpParseFormat(const char* name, FrameDumpFormat* format) {
+    if(strcmp(name, "raw") == 0) {
+        *format = DUMP_RAW;
+    } else if(strcmp(name, "ppm") == 0) {
+        *format = DUMP_PPM;
+    } else if(strcmp(name, "hash") == 0) {
+        *format = DUMP_HASH;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+FrameDump* frameDumpOpen(const char* path, FrameDumpFormat format) {
+    FILE* file = fopen(path, format == DUMP_HASH ? "w" : "wb");
+    if(file == NULL) {
+        printf("Error opening file\n");
+        return NULL;
+    }
+
+    FrameDump* dump = malloc(sizeof(FrameDump));
+    dump->format = format;
+    dump->file = file;
+    dump->frames = 0;
+    dump->row = NULL;
+    return dump;
+}
+
+//FNV-1a over the colors, so a palette change shows up as well
+static unsigned long long frameHash(Screen* screen, Palette* palette) {
+    unsigned long long hash = 14695981039346656037ull;
+    for (int i = 0; i < screen->width * screen->height; i++) {
+        Color color = palette->colors[screen->buffer[i]];
+        hash = (hash ^ color.r) * 1099511628211ull;
+        hash = (hash ^ color.g) * 1099511628211ull;
+        hash = (hash ^ color.b) * 1099511628211ull;
+    }
+    return hash;
+}
+
+void frameDumpWrite(FrameDump* dump, Screen* screen, Palette* palette) {
+    switch (dump->format) {
+        case DUMP_RAW:
+            fwrite(screen->buffer, 1, screen->width * screen->height, dump->file);
+            break;
+        case DUMP_PPM:
+            dump->row = realloc(dump->row, screen->width * 3);
+            fprintf(dump->file, "P6\n%d %d\n255\n", screen->width, screen->height);
+            for (int y = 0; y < screen->height; y++) {
+                for (int x = 0; x < screen->width; x++) {
+                    Color color = palette->colors[screen->buffer[y * screen->width + x]];
+                    dump->row[x * 3] = color.r;
+                    dump->row[x * 3 + 1] = color.g;
+                    dump->row[x * 3 + 2] = color.b;
+                }
+                fwrite(dump->row, 1, screen->width * 3, dump->file);
+            }
+            break;
+        case DUMP_HASH:
+            fprintf(dump->file, "%llu %016llx\n", dump->frames, frameHash(screen, palette));
+            break;
+    }
+    dump->frames++;
+}
+
+void frameDumpClose(FrameDump* dump) {
+    fclose(dump->file);
+    free(dump->row);
+    free(dump);
+}
@@ -0,0 +1,28 @@
+#ifndef FAKEOS_DUMP_H
+#define FAKEOS_DUMP_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "rendering.h"
+
+//Writes every presented frame to a file, for looking at headless runs and golden image checks
+typedef enum {
+    DUMP_RAW, //Indexed pixels of each frame back to back
+    DUMP_PPM, //One binary PPM image per frame, concatenated
+    DUMP_HASH, //One line per frame: frame number and a hash of its RGB pixels
+} FrameDumpFormat;
+
+typedef struct {
+    FrameDumpFormat format;
+    FILE* file;
+    unsigned long long frames;
+    unsigned char* row; //RGB scratch row for PPM
+} FrameDump;
+
+//Returns false and leaves *format alone for unknown names
+bool frameDumpParseFormat(const char* name, FrameDumpFormat* format);
+FrameDump* frameDumpOpen(const char* path, FrameDumpFormat format);
+void frameDumpWrite(FrameDump* dump, Screen* screen, Palette* palette);
+void frameDumpClose(FrameDump* dump);
+
+#endif //FAKEOS_DUMP_H
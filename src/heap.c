@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include "heap.h"
+
+#define LEAF(heap, address) ((heap)->leaves + (address))
+
+Heap* heapCreate(VM* vm) {
+    Heap* heap = malloc(sizeof(Heap));
+    heap->capacity = 64;
+    heap->allocations = malloc(sizeof(HeapAllocation) * heap->capacity);
+    heap->count = 0;
+    heap->peakBytes = 0;
+    heap->allocationCount = 0;
+    heap->freeCount = 0;
+    heap->leaves = 1;
+    while(heap->leaves < vm->heapSize) {
+        heap->leaves <<= 1;
+    }
+    heap->freeRuns = malloc(2 * heap->leaves * sizeof(unsigned short));
+    heap->slots = calloc(vm->heapSize, sizeof(unsigned short));
+    vm->heap = heap;
+    heapRebuild(vm);
+    return heap;
+}
+
+void heapDestroy(Heap* heap) {
+    if(heap == NULL) {
+        return;
+    }
+    free(heap->freeRuns);
+    free(heap->allocations);
+    free(heap->slots);
+    free(heap);
+}
+
+//Recomputes PAGE_ALLOCATED for the protection pages a range overlaps
+static void heapMarkPages(VM* vm, unsigned int address, unsigned int length) {
+    unsigned int last = (address + length - 1) >> PROTECT_PAGE_SHIFT;
+    for (unsigned int page = address >> PROTECT_PAGE_SHIFT; page <= last; page++) {
+        unsigned int start = page << PROTECT_PAGE_SHIFT;
+        unsigned int end = start + (1 << PROTECT_PAGE_SHIFT) > vm->memorySize ? vm->memorySize : start + (1 << PROTECT_PAGE_SHIFT);
+        bool full = memchr(vm->memoryMap + start, false, end - start) == NULL;
+        vm->pageFlags[page] = (vm->pageFlags[page] & ~PAGE_ALLOCATED) | (full ? PAGE_ALLOCATED : 0);
+    }
+}
+
+static void heapTrack(Heap* heap, int ptr, int size, int site) {
+    if(heap->count == heap->capacity) {
+        heap->capacity *= 2;
+        heap->allocations = realloc(heap->allocations, sizeof(HeapAllocation) * heap->capacity);
+    }
+    heap->allocations[heap->count] = (HeapAllocation) {(unsigned short)ptr, (unsigned short)size, (unsigned short)site};
+    heap->count++;
+    heap->slots[ptr] = (unsigned short)heap->count;
+    heap->liveBytes += size;
+    heap->freeBytes -= size;
+    if(heap->liveBytes > heap->peakBytes) {
+        heap->peakBytes = heap->liveBytes;
+    }
+}
+
+static void heapUntrack(Heap* heap, int ptr) {
+    int index = heap->slots[ptr] - 1;
+    heap->liveBytes -= heap->allocations[index].size;
+    heap->freeBytes += heap->allocations[index].size;
+    heap->slots[ptr] = 0;
+
+    //Move the last one into the hole
+    heap->count--;
+    if(index != heap->count) {
+        heap->allocations[index] = heap->allocations[heap->count];
+        heap->slots[heap->allocations[index].ptr] = (unsigned short)(index + 1);
+    }
+}
+
+void heapRebuild(VM* vm) {
+    Heap* heap = vm->heap;
+    unsigned short* tree = heap->freeRuns;
+
+    //Allocations that survived keep their site
+    HeapAllocation* old = heap->allocations;
+    int oldCount = heap->count;
+    heap->allocations = malloc(sizeof(HeapAllocation) * heap->capacity);
+    heap->count = 0;
+    heap->liveBytes = 0;
+    heap->freeBytes = vm->heapSize;
+    for (int i = 0; i < vm->heapSize; i++) {
+        if(vm->memoryMap[i] && vm->memorySizes[i] != 0) {
+            int slot = heap->slots[i];
+            bool kept = slot > 0 && slot <= oldCount && old[slot - 1].ptr == i && old[slot - 1].size == vm->memorySizes[i];
+            heap->slots[i] = 0;
+            heapTrack(heap, i, vm->memorySizes[i], kept ? old[slot - 1].site : HEAP_NO_SITE);
+        } else {
+            heap->slots[i] = 0;
+        }
+    }
+    free(old);
+
+    memset(tree + heap->leaves, 0, heap->leaves * sizeof(unsigned short));
+    for (int i = 0; i < vm->heapSize; i++) {
+        if(vm->memoryMap[i]) {
+            continue;
+        }
+        int start = i;
+        while(i < vm->heapSize && !vm->memoryMap[i]) {
+            i++;
+        }
+        tree[LEAF(heap, start)] = (unsigned short)(i - start);
+    }
+    for (int node = heap->leaves - 1; node > 0; node--) {
+        unsigned short left = tree[2 * node];
+        unsigned short right = tree[2 * node + 1];
+        tree[node] = left > right ? left : right;
+    }
+    heapMarkPages(vm, 0, vm->memorySize);
+}
+
+static void heapSetRun(VM* vm, int address, int length) {
+    Heap* heap = vm->heap;
+    unsigned short* tree = heap->freeRuns;
+    int node = LEAF(heap, address);
+    tree[node] = (unsigned short)length;
+    for (node >>= 1; node > 0; node >>= 1) {
+        unsigned short left = tree[2 * node];
+        unsigned short right = tree[2 * node + 1];
+        unsigned short longest = left > right ? left : right;
+        if(tree[node] == longest) {
+            break; //Nothing above changes either
+        }
+        tree[node] = longest;
+    }
+}
+
+//Start of the lowest free run of at least length bytes, or -1
+static int heapFindFit(VM* vm, int length) {
+    Heap* heap = vm->heap;
+    unsigned short* tree = heap->freeRuns;
+    if(tree[1] < length) {
+        return -1;
+    }
+    int node = 1;
+    while(node < heap->leaves) {
+        node = tree[2 * node] >= length ? 2 * node : 2 * node + 1;
+    }
+    return node - heap->leaves;
+}
+
+//Start of the free run that contains a free address, the closest run start at or below it
+static int heapFindRunStart(VM* vm, int address) {
+    Heap* heap = vm->heap;
+    unsigned short* tree = heap->freeRuns;
+    int node = LEAF(heap, address);
+    if(tree[node] > 0) {
+        return address;
+    }
+    //Climb until a left sibling holds a run, then take its rightmost one
+    while(!(node & 1) || tree[node - 1] == 0) {
+        node >>= 1;
+    }
+    node--;
+    while(node < heap->leaves) {
+        node = tree[2 * node + 1] > 0 ? 2 * node + 1 : 2 * node;
+    }
+    return node - heap->leaves;
+}
+
+//Allocations are charged to vm->ip, the ALC or the SYS that asked for them
+int vmAlloc(VM* vm, int size) {
+    Heap* heap = vm->heap;
+    //Zero sized allocations get the lowest free address without reserving it
+    int ptr = heapFindFit(vm, size > 0 ? size : 1);
+    if(ptr == -1) {
+        return -1;
+    }
+    if(size <= 0) {
+        vm->memorySizes[ptr] = HEAP_EMPTY;
+        vmTouchMemory(vm, ptr, 1);
+        return ptr;
+    }
+
+    int run = heap->freeRuns[LEAF(heap, ptr)];
+    heapSetRun(vm, ptr, 0);
+    if(run > size) {
+        heapSetRun(vm, ptr + size, run - size);
+    }
+    memset(vm->memoryMap + ptr, true, size);
+    //Drops what earlier frees left behind in the block
+    memset(vm->memorySizes + ptr, 0, size * sizeof(unsigned short));
+    vm->memorySizes[ptr] = size;
+    vmTouchMemory(vm, ptr, size);
+    heapMarkPages(vm, ptr, size);
+    heapTrack(heap, ptr, size, vm->ip);
+    heap->allocationCount++;
+    return ptr;
+}
+
+FreeResult vmFree(VM* vm, unsigned short ptr) {
+    Heap* heap = vm->heap;
+    int offset = ptr;
+    if(offset >= vm->heapSize) {
+        return FREE_INVALID;
+    }
+    if(heap->slots[offset] == 0) {
+        if(vm->memoryMap[offset]) {
+            return FREE_INVALID;
+        }
+        if(vm->memorySizes[offset] == HEAP_EMPTY) {
+            return FREE_OK;
+        }
+        return vm->memorySizes[offset] == HEAP_FREED ? FREE_DOUBLE : FREE_INVALID;
+    }
+    int size = vm->memorySizes[offset];
+    heapUntrack(heap, offset);
+    heap->freeCount++;
+    memset(vm->memoryMap + offset, false, size);
+    vm->memorySizes[offset] = HEAP_FREED;
+    vmTouchMemory(vm, offset, size);
+    heapMarkPages(vm, offset, size);
+
+    //Merge with the free runs on either side
+    int start = offset;
+    int end = offset + size;
+    if(end < vm->heapSize && !vm->memoryMap[end]) {
+        int next = heap->freeRuns[LEAF(heap, end)];
+        heapSetRun(vm, end, 0);
+        end += next;
+    }
+    if(start > 0 && !vm->memoryMap[start - 1]) {
+        start = heapFindRunStart(vm, start - 1);
+    }
+    heapSetRun(vm, start, end - start);
+    return FREE_OK;
+}
+
+HeapStats vmHeapStats(VM* vm) {
+    Heap* heap = vm->heap;
+    HeapStats stats;
+    stats.allocations = heap->count;
+    stats.liveBytes = heap->liveBytes;
+    stats.peakBytes = heap->peakBytes;
+    stats.freeBytes = heap->freeBytes;
+    stats.largestFree = heap->freeRuns[1];
+    stats.fragmentation = heap->freeBytes > 0 ? 100 - stats.largestFree * 100 / heap->freeBytes : 0;
+    stats.allocationCount = heap->allocationCount;
+    stats.freeCount = heap->freeCount;
+    return stats;
+}
+
+static int compareAllocations(const void* a, const void* b) {
+    return ((const HeapAllocation*)a)->ptr - ((const HeapAllocation*)b)->ptr;
+}
+
+//Make sure that all memory is freed before exiting
+void vmReportLeaks(VM* vm) {
+    Heap* heap = vm->heap;
+    if(heap->count == 0) {
+        return;
+    }
+    HeapAllocation* leaks = malloc(sizeof(HeapAllocation) * heap->count);
+    memcpy(leaks, heap->allocations, sizeof(HeapAllocation) * heap->count);
+    qsort(leaks, heap->count, sizeof(HeapAllocation), compareAllocations);
+    for (int i = 0; i < heap->count; i++) {
+        printf("Memory leak at %d\n    size %d\n", leaks[i].ptr, leaks[i].size);
+        if(leaks[i].site != HEAP_NO_SITE) {
+            printf("    allocated at byte %d\n", leaks[i].site);
+        }
+    }
+    free(leaks);
+}
@@ -0,0 +1,65 @@
+#ifndef FAKEOS_HEAP_H
+#define FAKEOS_HEAP_H
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "asm.h"
+
+//The heap keeps a max segment tree over the free runs of memoryMap. Each leaf holds the length
+//of the free run starting at that address (0 everywhere else) and each inner node the longest
+//run below it, so the lowest run that fits is found in O(log n) - the same address a first fit
+//scan of memoryMap returns. memoryMap and memorySizes stay the source of truth, the tree and
+//the allocation table can always be rebuilt from them.
+
+#define HEAP_NO_SITE 0xFFFF
+
+//memorySizes of an address nothing is allocated at says what FRE of it means, 0 is never allocated.
+//Keeping it there lets snapshots and recordings carry it along with the sizes.
+#define HEAP_FREED 0xFFFF //An allocation started here and was freed
+#define HEAP_EMPTY 0xFFFE //A zero sized allocation got this address, freeing it does nothing
+
+typedef struct {
+    unsigned short ptr;
+    unsigned short size;
+    unsigned short site; //Byte address of the instruction that allocated it, HEAP_NO_SITE if unknown
+} HeapAllocation;
+
+//Covers the memory below BANK_WINDOW, banked memory isn't allocated
+typedef struct Heap {
+    unsigned int leaves; //Power of two covering the heap
+    unsigned short* freeRuns; //2 * leaves nodes, node 1 is the root
+
+    //Live allocations in no particular order, slots maps a pointer to its index + 1
+    HeapAllocation* allocations;
+    int count;
+    int capacity;
+    unsigned short* slots;
+
+    int liveBytes;
+    int peakBytes;
+    int freeBytes;
+    unsigned long long allocationCount; //Since the VM was created
+    unsigned long long freeCount;
+} Heap;
+
+typedef struct {
+    int allocations;
+    int liveBytes;
+    int peakBytes;
+    int freeBytes;
+    int largestFree;
+    int fragmentation; //Percent of the free bytes outside the largest free run
+    unsigned long long allocationCount;
+    unsigned long long freeCount;
+} HeapStats;
+
+Heap* heapCreate(VM* vm);
+void heapDestroy(Heap* heap);
+
+//Call after memoryMap or memorySizes were changed outside of vmAlloc/vmFree
+void heapRebuild(VM* vm);
+
+HeapStats vmHeapStats(VM* vm);
+void vmReportLeaks(VM* vm);
+
+#endif //FAKEOS_HEAP_H
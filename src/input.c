@@ -0,0 +1,59 @@
+#include "input.h"
+
+void inputQueueInit(InputQueue* queue) {
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+bool inputQueuePush(InputQueue* queue, InputEvent event) {
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if(tail - head == INPUT_QUEUE_SIZE) {
+        return false;
+    }
+    queue->events[tail & (INPUT_QUEUE_SIZE - 1)] = event;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool inputQueuePop(InputQueue* queue, InputEvent* event) {
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if(head == tail) {
+        return false;
+    }
+    *event = queue->events[head & (INPUT_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+
+void inputStateApply(InputState* state, const InputEvent* event) {
+    if(event->type == INPUT_BUTTON_DOWN) {
+        state->buttons |= 1 << event->code;
+        state->pressed |= 1 << event->code;
+    } else if(event->type == INPUT_BUTTON_UP) {
+        state->buttons &= ~(1 << event->code);
+        state->released |= 1 << event->code;
+    } else if(event->type == INPUT_KEY) {
+        state->character = (unsigned short)event->code;
+    } else {
+        return;
+    }
+    if(state->since == 0) {
+        state->since = event->time;
+    }
+}
+
+unsigned long long inputStateLatch(InputState* state, unsigned short* registers) {
+    registers[INPUT_BUTTONS] = state->buttons;
+    registers[INPUT_PRESSED] = state->pressed;
+    registers[INPUT_RELEASED] = state->released;
+    registers[INPUT_CHARACTER] = state->character;
+
+    unsigned long long since = state->since;
+    state->pressed = 0;
+    state->released = 0;
+    state->character = 0;
+    state->since = 0;
+    return since;
+}
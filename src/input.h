@@ -0,0 +1,70 @@
+#ifndef FAKEOS_INPUT_H
+#define FAKEOS_INPUT_H
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define INPUT_QUEUE_SIZE 256 //Power of two
+
+typedef enum {
+    INPUT_QUIT, //The window was closed
+    INPUT_BUTTON_DOWN, //code is the InputButton
+    INPUT_BUTTON_UP,
+    INPUT_KEY, //A character key was pressed, code is its ASCII value
+} InputEventType;
+
+//Bit numbers in the button registers, keys and gamepads both map to these
+typedef enum {
+    BUTTON_UP,
+    BUTTON_DOWN,
+    BUTTON_LEFT,
+    BUTTON_RIGHT,
+    BUTTON_A,
+    BUTTON_B,
+    BUTTON_START,
+    BUTTON_SELECT,
+} InputButton;
+
+typedef struct {
+    InputEventType type;
+    int code;
+    unsigned long long time; //When it happened, on the telemetryNow clock
+} InputEvent;
+
+//Events from the thread owning the window to the VM thread. One thread pushes and one pops,
+//so the two indices are enough and neither side ever waits for the other.
+typedef struct {
+    InputEvent events[INPUT_QUEUE_SIZE];
+    atomic_uint head; //Next event to pop, only moved by the reader
+    atomic_uint tail; //Next free slot, only moved by the writer
+} InputQueue;
+
+void inputQueueInit(InputQueue* queue);
+//Returns false and drops the event when the queue is full
+bool inputQueuePush(InputQueue* queue, InputEvent event);
+bool inputQueuePop(InputQueue* queue, InputEvent* event);
+
+//What INP reads. The host latches them once a frame, so a program sees the same input until
+//it flushes the screen again and a press shorter than a frame still shows up in INPUT_PRESSED.
+typedef enum {
+    INPUT_BUTTONS, //Buttons held down
+    INPUT_PRESSED, //Buttons that went down during the last frame
+    INPUT_RELEASED, //Buttons that went up during the last frame
+    INPUT_CHARACTER, //Last character key pressed during the last frame, 0 for none
+    INPUT_REGISTER_COUNT,
+} InputRegister;
+
+//Events applied since the last latch, only used by the VM thread
+typedef struct {
+    unsigned short buttons;
+    unsigned short pressed;
+    unsigned short released;
+    unsigned short character;
+    unsigned long long since; //Time of the oldest event applied, 0 for none
+} InputState;
+
+void inputStateApply(InputState* state, const InputEvent* event);
+//Copies the state into the registers and starts the next frame. Returns the time of the
+//oldest event in them, 0 if nothing happened.
+unsigned long long inputStateLatch(InputState* state, unsigned short* registers);
+
+#endif //FAKEOS_INPUT_H
@@ -0,0 +1,904 @@
+#define _DEFAULT_SOURCE //MAP_ANONYMOUS under strict C11
+#include "jit.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_X86_64
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef JIT_X86_64
+
+#define JIT_MAX_BLOCK 64 //Instructions per block before chaining to the next one
+#define JIT_INSTRUCTION_SPACE 256 //Worst case bytes per instruction, stubs included
+#define JIT_BLOCK_SPACE (JIT_MAX_BLOCK * JIT_INSTRUCTION_SPACE + 64)
+
+//Exit codes returned to jitRun, the instruction index to continue at and whether to interpret it
+#define EXIT_CONTINUE(index) ((index) << 1)
+#define EXIT_INTERPRET(index) (((index) << 1) | 1)
+
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+#define VM_BASE R15 //Holds the VM* while native code runs
+#define FLAGS R14 //Holds cmpFlags while native code runs
+#define BUDGET R13 //Holds the cycle budget while native code runs
+
+//RDI only carries the VM* into the entry stub, after that it is free like the caller saved R8 - R11
+static const int pinnableRegisters[] = {RBX, RBP, R8, R9, R10, R11, R12, RDI};
+
+#define REGISTER_OFFSET(reg) (offsetof(VM, registers) + (reg) * sizeof(unsigned short))
+
+typedef unsigned int (*JitEntry)(VM* vm, unsigned char* block);
+
+typedef struct {
+    unsigned int site;
+    unsigned int code;
+    bool chain; //Retarget the site once the block of the target exists
+} JitStub;
+
+typedef struct {
+    Jit* jit;
+    VM* vm;
+    JitStub stubs[JIT_MAX_BLOCK * 4 + 2];
+    int stubCount;
+    int pendingCycles; //Cost of the instructions compiled since the budget was last charged
+} Compiler;
+
+//region Emitter
+
+static void emit8(Jit* jit, unsigned char byte) {
+    jit->code[jit->size] = byte;
+    jit->size++;
+}
+
+static void emit16(Jit* jit, unsigned short value) {
+    memcpy(jit->code + jit->size, &value, 2);
+    jit->size += 2;
+}
+
+static void emit32(Jit* jit, unsigned int value) {
+    memcpy(jit->code + jit->size, &value, 4);
+    jit->size += 4;
+}
+
+static void emit64(Jit* jit, unsigned long long value) {
+    memcpy(jit->code + jit->size, &value, 8);
+    jit->size += 8;
+}
+
+static void patchRel32(Jit* jit, unsigned int site, unsigned int destination) {
+    int rel = (int)destination - (int)(site + 4);
+    memcpy(jit->code + site, &rel, 4);
+}
+
+static void emitRex(Jit* jit, bool wide, int reg, int index, int base) {
+    unsigned char rex = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+    if(rex != 0x40) {
+        emit8(jit, rex);
+    }
+}
+
+static void emitOpcode(Jit* jit, int opcode) {
+    if(opcode > 0xFF) {
+        emit8(jit, opcode >> 8);
+    }
+    emit8(jit, opcode & 0xFF);
+}
+
+//op reg, rm with two host registers
+static void emitRR(Jit* jit, int opcode, int reg, int rm) {
+    emitRex(jit, false, reg, 0, rm);
+    emitOpcode(jit, opcode);
+    emit8(jit, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+//64 bit op reg, rm
+static void emitRR64(Jit* jit, int opcode, int reg, int rm) {
+    emitRex(jit, true, reg, 0, rm);
+    emitOpcode(jit, opcode);
+    emit8(jit, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+//op reg, [VM_BASE + disp32]
+static void emitVM(Jit* jit, int opcode, int reg, unsigned int disp) {
+    emitRex(jit, false, reg, 0, VM_BASE);
+    emitOpcode(jit, opcode);
+    emit8(jit, 0x80 | ((reg & 7) << 3) | (VM_BASE & 7));
+    emit32(jit, disp);
+}
+
+//64 bit op reg, [VM_BASE + disp32]
+static void emitVM64(Jit* jit, int opcode, int reg, unsigned int disp) {
+    emitRex(jit, true, reg, 0, VM_BASE);
+    emitOpcode(jit, opcode);
+    emit8(jit, 0x80 | ((reg & 7) << 3) | (VM_BASE & 7));
+    emit32(jit, disp);
+}
+
+//op reg, [VM_BASE + RAX * 2 + disp32]
+static void emitVMIndexed(Jit* jit, int opcode, int reg, unsigned int disp) {
+    emitRex(jit, false, reg, RAX, VM_BASE);
+    emitOpcode(jit, opcode);
+    emit8(jit, 0x84 | ((reg & 7) << 3));
+    emit8(jit, 0x40 | (RAX << 3) | (VM_BASE & 7));
+    emit32(jit, disp);
+}
+
+static void emitMovImm(Jit* jit, int reg, unsigned int value) {
+    emitRex(jit, false, 0, 0, reg);
+    emit8(jit, 0xB8 + (reg & 7));
+    emit32(jit, value);
+}
+
+static void emitJump(Jit* jit, unsigned int destination) {
+    emit8(jit, 0xE9);
+    unsigned int site = jit->size;
+    emit32(jit, 0);
+    patchRel32(jit, site, destination);
+}
+
+static void emitExit(Jit* jit, unsigned int code) {
+    emitMovImm(jit, RAX, code);
+    emitJump(jit, jit->exit);
+}
+
+//endregion
+
+//region Guest registers
+
+//Loads an operand into a scratch register. Only the low 16 bits are meaningful.
+static void loadOperand(Jit* jit, int host, Operand operand) {
+    if(operand.reg == ZERO_REGISTER) {
+        emitMovImm(jit, host, operand.value);
+    } else if(jit->hostRegisters[operand.reg] >= 0) {
+        emitRR(jit, 0x89, jit->hostRegisters[operand.reg], host);
+    } else {
+        emitVM(jit, 0x0FB7, host, REGISTER_OFFSET(operand.reg));
+    }
+}
+
+static void storeRegister(Jit* jit, unsigned char reg, int host) {
+    if(jit->hostRegisters[reg] >= 0) {
+        emitRR(jit, 0x89, host, jit->hostRegisters[reg]);
+    } else {
+        emit8(jit, 0x66);
+        emitVM(jit, 0x89, host, REGISTER_OFFSET(reg));
+    }
+}
+
+static bool hasDestination(unsigned char op) {
+    switch (op) {
+        case MOV:
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case ALC:
+        case LDB:
+        case LDW:
+            return true;
+    }
+    return false;
+}
+
+//Keep the most used guest registers in host registers for the whole program
+static void pinRegisters(Jit* jit, VM* vm) {
+    int uses[REGISTER_COUNT] = {0};
+    for (unsigned int i = 0; i < vm->programLength; i++) {
+        Instruction* ins = &vm->program[i];
+        unsigned char op = vmUnfusedOp(vm, ins);
+        if(op == BAD) {
+            continue;
+        }
+        if(hasDestination(op)) {
+            uses[ins->dst]++;
+        }
+        for (int j = 0; j < 3; j++) {
+            if(ins->args[j].reg != ZERO_REGISTER) {
+                uses[ins->args[j].reg]++;
+            }
+        }
+    }
+
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        jit->hostRegisters[i] = -1;
+    }
+    int count = sizeof(pinnableRegisters) / sizeof(pinnableRegisters[0]);
+    for (int i = 0; i < count; i++) {
+        int best = -1;
+        for (int reg = 0; reg < REGISTER_COUNT; reg++) {
+            if(jit->hostRegisters[reg] == -1 && uses[reg] > 0 && (best == -1 || uses[reg] > uses[best])) {
+                best = reg;
+            }
+        }
+        if(best == -1) {
+            break;
+        }
+        jit->hostRegisters[best] = pinnableRegisters[i];
+    }
+}
+
+//endregion
+
+//region Stubs
+
+static void emitEnter(Jit* jit) {
+    jit->enter = jit->size;
+    emit8(jit, 0x53); //push rbx
+    emit8(jit, 0x55); //push rbp
+    emit8(jit, 0x41); emit8(jit, 0x54); //push r12
+    emit8(jit, 0x41); emit8(jit, 0x55); //push r13
+    emit8(jit, 0x41); emit8(jit, 0x56); //push r14
+    emit8(jit, 0x41); emit8(jit, 0x57); //push r15
+    emit8(jit, 0x49); emit8(jit, 0x89); emit8(jit, 0xFF); //mov r15, rdi
+    emitVM(jit, 0x0FB6, FLAGS, offsetof(VM, cmpFlags));
+    emitVM64(jit, 0x8B, BUDGET, offsetof(VM, budget));
+    for (int reg = 0; reg < REGISTER_COUNT; reg++) {
+        if(jit->hostRegisters[reg] >= 0) {
+            emitVM(jit, 0x0FB7, jit->hostRegisters[reg], REGISTER_OFFSET(reg));
+        }
+    }
+    emit8(jit, 0xFF); emit8(jit, 0xE6); //jmp rsi
+}
+
+static void emitExitStub(Jit* jit) {
+    jit->exit = jit->size;
+    emitVM(jit, 0x88, FLAGS, offsetof(VM, cmpFlags));
+    emitVM64(jit, 0x89, BUDGET, offsetof(VM, budget));
+    for (int reg = 0; reg < REGISTER_COUNT; reg++) {
+        if(jit->hostRegisters[reg] >= 0) {
+            emit8(jit, 0x66);
+            emitVM(jit, 0x89, jit->hostRegisters[reg], REGISTER_OFFSET(reg));
+        }
+    }
+    emit8(jit, 0x41); emit8(jit, 0x5F); //pop r15
+    emit8(jit, 0x41); emit8(jit, 0x5E); //pop r14
+    emit8(jit, 0x41); emit8(jit, 0x5D); //pop r13
+    emit8(jit, 0x41); emit8(jit, 0x5C); //pop r12
+    emit8(jit, 0x5D); //pop rbp
+    emit8(jit, 0x5B); //pop rbx
+    emit8(jit, 0xC3); //ret
+}
+
+//Jumps to the block of a byte address in eax, ecx holds the index of the jumping instruction
+//and esi the cycles it was charged. Used by RET and register jumps, whose targets are only known at run time.
+static void emitDispatchStub(Jit* jit, VM* vm) {
+    jit->dispatch = jit->size;
+
+    emitRR(jit, 0x81, 7, RAX); //cmp eax, codeLength
+    emit32(jit, vm->codeLength);
+    emit8(jit, 0x0F); emit8(jit, 0x83); //jae end
+    unsigned int toEnd = jit->size;
+    emit32(jit, 0);
+
+    emit8(jit, 0x48); emit8(jit, 0xBA); //mov rdx, addressMap
+    emit64(jit, (unsigned long long)(size_t)vm->addressMap);
+    emit8(jit, 0x8B); emit8(jit, 0x04); emit8(jit, 0x82); //mov eax, [rdx + rax * 4]
+    emit8(jit, 0x83); emit8(jit, 0xF8); emit8(jit, 0xFF); //cmp eax, -1
+    emit8(jit, 0x0F); emit8(jit, 0x84); //je invalid
+    unsigned int toInvalid = jit->size;
+    emit32(jit, 0);
+
+    emit8(jit, 0x48); emit8(jit, 0xBA); //mov rdx, blocks
+    emit64(jit, (unsigned long long)(size_t)jit->blocks);
+    emit8(jit, 0x48); emit8(jit, 0x8B); emit8(jit, 0x14); emit8(jit, 0xC2); //mov rdx, [rdx + rax * 8]
+    emit8(jit, 0x48); emit8(jit, 0x85); emit8(jit, 0xD2); //test rdx, rdx
+    emit8(jit, 0x0F); emit8(jit, 0x84); //jz not compiled
+    unsigned int toMissing = jit->size;
+    emit32(jit, 0);
+    emit8(jit, 0xFF); emit8(jit, 0xE2); //jmp rdx
+
+    patchRel32(jit, toMissing, jit->size);
+    emit8(jit, 0x01); emit8(jit, 0xC0); //add eax, eax
+    emitJump(jit, jit->exit);
+
+    //Let the interpreter report the bad target, it charges the jump again
+    patchRel32(jit, toInvalid, jit->size);
+    emitRR64(jit, 0x01, RSI, BUDGET); //add budget, rsi
+    emit8(jit, 0x8D); emit8(jit, 0x44); emit8(jit, 0x09); emit8(jit, 0x01); //lea eax, [rcx + rcx + 1]
+    emitJump(jit, jit->exit);
+
+    patchRel32(jit, toEnd, jit->size);
+    emitExit(jit, EXIT_CONTINUE(vm->programLength));
+}
+
+//endregion
+
+//region Blocks
+
+static void addPatch(Jit* jit, unsigned int site, unsigned int target) {
+    if(jit->patchCount >= jit->patchCapacity) {
+        jit->patchCapacity = jit->patchCapacity == 0 ? 64 : jit->patchCapacity * 2;
+        jit->patches = realloc(jit->patches, sizeof(JitPatch) * jit->patchCapacity);
+    }
+    jit->patches[jit->patchCount] = (JitPatch){site, target};
+    jit->patchCount++;
+}
+
+//Points every branch that was waiting for this block straight at it
+static void chainBlock(Jit* jit, unsigned int index) {
+    for (int i = 0; i < jit->patchCount; i++) {
+        if(jit->patches[i].target == index) {
+            patchRel32(jit, jit->patches[i].site, jit->blocks[index] - jit->code);
+            jit->patches[i] = jit->patches[jit->patchCount - 1];
+            jit->patchCount--;
+            i--;
+        }
+    }
+}
+
+static void addStub(Compiler* compiler, unsigned int site, unsigned int code, bool chain) {
+    compiler->stubs[compiler->stubCount] = (JitStub){site, code, chain};
+    compiler->stubCount++;
+}
+
+//Takes the cost of the instructions so far off the budget. Must happen before anything leaves
+//the straight line code, lea keeps the host flags of a pending jcc intact.
+static void chargeCycles(Compiler* compiler) {
+    Jit* jit = compiler->jit;
+    if(compiler->pendingCycles == 0) {
+        return;
+    }
+    emitRex(jit, true, BUDGET, 0, BUDGET);
+    emit8(jit, 0x8D); //lea budget, [budget - cycles]
+    emit8(jit, 0x80 | ((BUDGET & 7) << 3) | (BUDGET & 7));
+    emit32(jit, -compiler->pendingCycles);
+    compiler->pendingCycles = 0;
+}
+
+//jmp or jcc to an instruction, direct when its block exists, through an exit stub otherwise
+static void emitBranch(Compiler* compiler, int opcode, unsigned int target) {
+    Jit* jit = compiler->jit;
+    chargeCycles(compiler);
+    emitOpcode(jit, opcode);
+    unsigned int site = jit->size;
+    emit32(jit, 0);
+    if(target < compiler->vm->programLength && jit->blocks[target] != NULL) {
+        patchRel32(jit, site, jit->blocks[target] - jit->code);
+    } else {
+        addStub(compiler, site, EXIT_CONTINUE(target), target < compiler->vm->programLength);
+    }
+}
+
+//jcc to an exit that runs the instruction in the interpreter, which raises the error
+static void emitBail(Compiler* compiler, int opcode, unsigned int index) {
+    Jit* jit = compiler->jit;
+    chargeCycles(compiler);
+    emitOpcode(jit, opcode);
+    unsigned int site = jit->size;
+    emit32(jit, 0);
+    addStub(compiler, site, EXIT_INTERPRET(index), false);
+}
+
+//Emits jcc over the code that follows, returns the site to patch with patchRel32
+static unsigned int emitSkipUnless(Jit* jit, unsigned char op) {
+    unsigned char mask = CMP_EQUAL;
+    bool ifSet = true;
+    switch (op) {
+        case JNE:
+        case BNE:
+            ifSet = false;
+            break;
+        case JLT:
+        case BLT:
+            mask = CMP_LESS;
+            break;
+        case JGT:
+        case BGT:
+            mask = CMP_GREATER;
+            break;
+    }
+    emitRR(jit, 0xF6, 0, FLAGS); //test flags, mask
+    emit8(jit, mask);
+    emitOpcode(jit, ifSet ? 0x0F84 : 0x0F85);
+    unsigned int site = jit->size;
+    emit32(jit, 0);
+    return site;
+}
+
+//Leaves cp in eax, bails out before anything is charged when the call stack is full
+static void emitCallCheck(Compiler* compiler, unsigned int index) {
+    Jit* jit = compiler->jit;
+    emitVM(jit, 0x0FB7, RAX, offsetof(VM, cp)); //movzx eax, word [cp]
+    emitRR(jit, 0x81, 7, RAX); //cmp eax, 256
+    emit32(jit, 256);
+    emitBail(compiler, 0x0F83, index);
+}
+
+static void emitCall(Compiler* compiler, Instruction* ins) {
+    Jit* jit = compiler->jit;
+    emit8(jit, 0x66); //mov word [callStack + rax * 2], return address
+    emitVMIndexed(jit, 0xC7, 0, offsetof(VM, callStack));
+    emit16(jit, ins[1].address);
+    emitRR(jit, 0xFF, 0, RAX); //inc eax
+    emit8(jit, 0x66);
+    emitVM(jit, 0x89, RAX, offsetof(VM, cp));
+    emitBranch(compiler, 0xE9, ins->target);
+}
+
+static void emitDynamicJump(Compiler* compiler, Instruction* ins, unsigned int index, unsigned short cycles) {
+    Jit* jit = compiler->jit;
+    loadOperand(jit, RAX, ins->args[0]);
+    emitRR(jit, 0x0FB7, RAX, RAX); //movzx eax, ax
+    emitMovImm(jit, RCX, index);
+    emitMovImm(jit, RSI, cycles);
+    emitJump(jit, jit->dispatch);
+}
+
+static void emitCompare(Jit* jit, Instruction* ins) {
+    loadOperand(jit, RAX, ins->args[0]);
+    if(ins->args[1].reg == ZERO_REGISTER) {
+        emit8(jit, 0x66);
+        emitRR(jit, 0x81, 7, RAX); //cmp ax, imm16
+        emit16(jit, ins->args[1].value);
+    } else {
+        loadOperand(jit, RCX, ins->args[1]);
+        emit8(jit, 0x66);
+        emitRR(jit, 0x39, RCX, RAX); //cmp ax, cx
+    }
+    emitRR(jit, 0x0F94, 0, RAX); //sete al
+    emitRR(jit, 0x0F9C, 0, RCX); //setl cl
+    emitRR(jit, 0x0F9F, 0, RDX); //setg dl
+    emit8(jit, 0x00); emit8(jit, 0xC9); //add cl, cl
+    emit8(jit, 0xC0); emit8(jit, 0xE2); emit8(jit, 0x02); //shl dl, 2
+    emit8(jit, 0x08); emit8(jit, 0xC8); //or al, cl
+    emit8(jit, 0x08); emit8(jit, 0xD0); //or al, dl
+    emitRR(jit, 0x80, 4, FLAGS); //and flags, ~(EQUAL | LESS | GREATER)
+    emit8(jit, (unsigned char)~(CMP_EQUAL | CMP_LESS | CMP_GREATER));
+    emitRR(jit, 0x08, RAX, FLAGS); //or flags, al
+}
+
+static void emitArithmetic(Compiler* compiler, Instruction* ins, unsigned char op, unsigned int index) {
+    Jit* jit = compiler->jit;
+    loadOperand(jit, RAX, ins->args[0]);
+    if(op == DIV) {
+        loadOperand(jit, RCX, ins->args[1]);
+        emitRR(jit, 0x0FBF, RAX, RAX); //movsx eax, ax
+        emitRR(jit, 0x0FBF, RCX, RCX); //movsx ecx, cx
+        emitRR(jit, 0x85, RCX, RCX); //test ecx, ecx
+        emitBail(compiler, 0x0F84, index);
+        emit8(jit, 0x99); //cdq
+        emitRR(jit, 0xF7, 7, RCX); //idiv ecx
+    } else if(ins->args[1].reg == ZERO_REGISTER) {
+        switch (op) {
+            case ADD:
+                emitRR(jit, 0x81, 0, RAX);
+                break;
+            case SUB:
+                emitRR(jit, 0x81, 5, RAX);
+                break;
+            case MUL:
+                emitRR(jit, 0x69, RAX, RAX);
+                break;
+        }
+        emit32(jit, ins->args[1].value);
+    } else {
+        loadOperand(jit, RCX, ins->args[1]);
+        switch (op) {
+            case ADD:
+                emitRR(jit, 0x01, RCX, RAX);
+                break;
+            case SUB:
+                emitRR(jit, 0x29, RCX, RAX);
+                break;
+            case MUL:
+                emitRR(jit, 0x0FAF, RAX, RCX);
+                break;
+        }
+    }
+    storeRegister(jit, ins->dst, RAX);
+}
+
+//Leaves the physical address of ptr + offset in rax and memory in rdx, bails out when the program
+//may not access the width bytes there. A word may straddle two protection pages, both have to allow it.
+static void emitMemoryAddress(Compiler* compiler, Instruction* ins, unsigned int index, unsigned char access, int width) {
+    Jit* jit = compiler->jit;
+    VM* vm = compiler->vm;
+    unsigned char required = access | PAGE_ALLOCATED;
+    loadOperand(jit, RAX, ins->args[0]);
+    loadOperand(jit, RCX, ins->args[1]);
+    emitRR(jit, 0x01, RCX, RAX); //add eax, ecx
+    emitRR(jit, 0x0FB7, RAX, RAX); //movzx eax, ax
+    if(width == 2) {
+        //A word at the end of a bank sized region may cross into the window, the interpreter sorts that out
+        emitRR(jit, 0x89, RAX, RDX); //mov edx, eax
+        emitRR(jit, 0x81, 4, RDX); //and edx, BANK_SIZE - 1
+        emit32(jit, BANK_SIZE - 1);
+        emitRR(jit, 0x81, 7, RDX); //cmp edx, BANK_SIZE - 1
+        emit32(jit, BANK_SIZE - 1);
+        emitBail(compiler, 0x0F84, index);
+    }
+    emitRR(jit, 0x89, RAX, RDX); //mov edx, eax
+    emitRR(jit, 0xC1, 5, RDX); //shr edx, BANK_SHIFT
+    emit8(jit, BANK_SHIFT);
+    emit8(jit, 0x41); emit8(jit, 0x03); emit8(jit, 0x84); emit8(jit, 0x97); //add eax, [r15 + rdx * 4 + bankOffsets]
+    emit32(jit, offsetof(VM, bankOffsets));
+    emitRR(jit, 0x81, 7, RAX); //cmp eax, memorySize - width + 1
+    emit32(jit, vm->memorySize - width + 1);
+    emitBail(compiler, 0x0F83, index);
+
+    emit8(jit, 0x49); emit8(jit, 0x8B); emit8(jit, 0x8F); //mov rcx, [r15 + pageFlags]
+    emit32(jit, offsetof(VM, pageFlags));
+    emitRR(jit, 0x89, RAX, RDX); //mov edx, eax
+    emitRR(jit, 0xC1, 5, RDX); //shr edx, PROTECT_PAGE_SHIFT
+    emit8(jit, PROTECT_PAGE_SHIFT);
+    emit8(jit, 0x0F); emit8(jit, 0xB6); emit8(jit, 0x14); emit8(jit, 0x11); //movzx edx, byte [rcx + rdx]
+    if(width == 2) {
+        emit8(jit, 0x8D); emit8(jit, 0x70); emit8(jit, 0x01); //lea esi, [rax + 1]
+        emitRR(jit, 0xC1, 5, RSI); //shr esi, PROTECT_PAGE_SHIFT
+        emit8(jit, PROTECT_PAGE_SHIFT);
+        emit8(jit, 0x22); emit8(jit, 0x14); emit8(jit, 0x31); //and dl, [rcx + rsi]
+    }
+    emitRR(jit, 0x83, 4, RDX); //and edx, required
+    emit8(jit, required);
+    emitRR(jit, 0x83, 7, RDX); //cmp edx, required
+    emit8(jit, required);
+    emitOpcode(jit, 0x0F84); //je allowed
+    unsigned int allowed = jit->size;
+    emit32(jit, 0);
+
+    //Partly allocated page, the bytes themselves decide
+    emit8(jit, 0xF6); emit8(jit, 0xC2); emit8(jit, access); //test dl, access
+    emitBail(compiler, 0x0F84, index);
+    emit8(jit, 0x49); emit8(jit, 0x8B); emit8(jit, 0x97); //mov rdx, [r15 + memoryMap]
+    emit32(jit, offsetof(VM, memoryMap));
+    if(width == 2) {
+        emit8(jit, 0x0F); emit8(jit, 0xB7); emit8(jit, 0x0C); emit8(jit, 0x02); //movzx ecx, word [rdx + rax]
+        emitRR(jit, 0x81, 7, RCX); //cmp ecx, 0x0101, both bools set
+        emit32(jit, 0x0101);
+        emitBail(compiler, 0x0F85, index);
+    } else {
+        emit8(jit, 0x80); emit8(jit, 0x3C); emit8(jit, 0x02); emit8(jit, 0x00); //cmp byte [rdx + rax], 0
+        emitBail(compiler, 0x0F84, index);
+    }
+
+    patchRel32(jit, allowed, jit->size);
+    emit8(jit, 0x49); emit8(jit, 0x8B); emit8(jit, 0x97); //mov rdx, [r15 + memory]
+    emit32(jit, offsetof(VM, memory));
+}
+
+//Stamps the snapshot pages of the width bytes at rax, clobbers rax, rcx, rdx and rsi
+static void emitTouchMemory(Jit* jit, int width) {
+    emitVM(jit, 0x8B, RCX, offsetof(VM, generation));
+    emit8(jit, 0x49); emit8(jit, 0x8B); emit8(jit, 0x97); //mov rdx, [r15 + pageVersions]
+    emit32(jit, offsetof(VM, pageVersions));
+    if(width == 2) {
+        emit8(jit, 0x8D); emit8(jit, 0x70); emit8(jit, 0x01); //lea esi, [rax + 1]
+        emitRR(jit, 0xC1, 5, RSI); //shr esi, MEMORY_PAGE_SHIFT
+        emit8(jit, MEMORY_PAGE_SHIFT);
+        emit8(jit, 0x89); emit8(jit, 0x0C); emit8(jit, 0xB2); //mov [rdx + rsi * 4], ecx
+    }
+    emitRR(jit, 0xC1, 5, RAX); //shr eax, MEMORY_PAGE_SHIFT
+    emit8(jit, MEMORY_PAGE_SHIFT);
+    emit8(jit, 0x89); emit8(jit, 0x0C); emit8(jit, 0x82); //mov [rdx + rax * 4], ecx
+}
+
+//Compiles one instruction, returns false when it ends the block.
+//Each instruction is charged once it can no longer bail out to the interpreter.
+static bool compileInstruction(Compiler* compiler, unsigned int index) {
+    Jit* jit = compiler->jit;
+    VM* vm = compiler->vm;
+    Instruction* ins = &vm->program[index];
+    unsigned char op = vmUnfusedOp(vm, ins);
+    unsigned short cycles = vm->cycleCosts[op];
+    bool immediate = ins->args[0].reg == ZERO_REGISTER;
+
+    switch (op) {
+        case NOP:
+            compiler->pendingCycles += cycles;
+            return true;
+        case MOV:
+            loadOperand(jit, RAX, ins->args[0]);
+            storeRegister(jit, ins->dst, RAX);
+            compiler->pendingCycles += cycles;
+            return true;
+        case INP:
+            if(!immediate || ins->args[0].value >= INPUT_REGISTER_COUNT) {
+                break;
+            }
+            emitVM(jit, 0x0FB7, RAX, offsetof(VM, input) + ins->args[0].value * sizeof(unsigned short)); //movzx eax, word [input + index]
+            storeRegister(jit, ins->dst, RAX);
+            compiler->pendingCycles += cycles;
+            return true;
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+            emitArithmetic(compiler, ins, op, index);
+            compiler->pendingCycles += cycles;
+            return true;
+        case CMP:
+            emitCompare(jit, ins);
+            compiler->pendingCycles += cycles;
+            return true;
+        case JMP:
+            if(!immediate) {
+                compiler->pendingCycles += cycles;
+                chargeCycles(compiler);
+                emitDynamicJump(compiler, ins, index, cycles);
+            } else if(ins->target != NO_INSTRUCTION) {
+                compiler->pendingCycles += cycles;
+                emitBranch(compiler, 0xE9, ins->target);
+            } else {
+                break;
+            }
+            return false;
+        case JEQ:
+        case JNE:
+        case JLT:
+        case JGT: {
+            if(immediate && ins->target == NO_INSTRUCTION) {
+                break;
+            }
+            compiler->pendingCycles += cycles;
+            chargeCycles(compiler);
+            unsigned int skip = emitSkipUnless(jit, op);
+            if(immediate) {
+                emitBranch(compiler, 0xE9, ins->target);
+            } else {
+                emitDynamicJump(compiler, ins, index, cycles);
+            }
+            patchRel32(jit, skip, jit->size);
+            return true;
+        }
+        case BRN:
+            if(!immediate || ins->target == NO_INSTRUCTION) {
+                break;
+            }
+            emitCallCheck(compiler, index);
+            compiler->pendingCycles += cycles;
+            emitCall(compiler, ins);
+            return false;
+        case BEQ:
+        case BNE:
+        case BLT:
+        case BGT: {
+            if(!immediate || ins->target == NO_INSTRUCTION) {
+                break;
+            }
+            //Checked even when the call isn't taken, the interpreter sorts that out
+            emitCallCheck(compiler, index);
+            compiler->pendingCycles += cycles;
+            chargeCycles(compiler);
+            unsigned int skip = emitSkipUnless(jit, op);
+            emitCall(compiler, ins);
+            patchRel32(jit, skip, jit->size);
+            return true;
+        }
+        case RET:
+            emitVM(jit, 0x0FB7, RAX, offsetof(VM, cp)); //movzx eax, word [cp]
+            emitRR(jit, 0x85, RAX, RAX); //test eax, eax
+            emitBail(compiler, 0x0F84, index);
+            compiler->pendingCycles += cycles;
+            chargeCycles(compiler);
+            emitRR(jit, 0xFF, 1, RAX); //dec eax
+            emit8(jit, 0x66);
+            emitVM(jit, 0x89, RAX, offsetof(VM, cp));
+            emitVMIndexed(jit, 0x0FB7, RAX, offsetof(VM, callStack)); //movzx eax, word [callStack + rax * 2]
+            emitMovImm(jit, RCX, index);
+            emitMovImm(jit, RSI, cycles);
+            emitJump(jit, jit->dispatch);
+            return false;
+        case STB:
+            emitMemoryAddress(compiler, ins, index, PAGE_WRITE, 1);
+            loadOperand(jit, RCX, ins->args[2]);
+            emit8(jit, 0x88); emit8(jit, 0x0C); emit8(jit, 0x02); //mov byte [rdx + rax], cl
+            emitTouchMemory(jit, 1);
+            compiler->pendingCycles += cycles;
+            return true;
+        case STW:
+            emitMemoryAddress(compiler, ins, index, PAGE_WRITE, 2);
+            loadOperand(jit, RCX, ins->args[2]);
+            emit8(jit, 0x66); emit8(jit, 0x89); emit8(jit, 0x0C); emit8(jit, 0x02); //mov word [rdx + rax], cx
+            emitTouchMemory(jit, 2);
+            compiler->pendingCycles += cycles;
+            return true;
+        case LDB:
+            emitMemoryAddress(compiler, ins, index, PAGE_READ, 1);
+            emit8(jit, 0x0F); emit8(jit, 0xB6); emit8(jit, 0x04); emit8(jit, 0x02); //movzx eax, byte [rdx + rax]
+            storeRegister(jit, ins->dst, RAX);
+            compiler->pendingCycles += cycles;
+            return true;
+        case LDW:
+            emitMemoryAddress(compiler, ins, index, PAGE_READ, 2);
+            emit8(jit, 0x0F); emit8(jit, 0xB7); emit8(jit, 0x04); emit8(jit, 0x02); //movzx eax, word [rdx + rax]
+            storeRegister(jit, ins->dst, RAX);
+            compiler->pendingCycles += cycles;
+            return true;
+        case END:
+            emitBranch(compiler, 0xE9, index);
+            return false;
+    }
+
+    //SYS, ALC, FRE, drawing, sprites, CPY, FIL, BNK, WAI and malformed instructions go back to C
+    chargeCycles(compiler);
+    emitExit(jit, EXIT_INTERPRET(index));
+    return false;
+}
+
+static bool canCompile(VM* vm, unsigned int index) {
+    Instruction* ins = &vm->program[index];
+    switch (vmUnfusedOp(vm, ins)) {
+        case NOP:
+        case MOV:
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case CMP:
+        case JEQ:
+        case JNE:
+        case JLT:
+        case JGT:
+        case RET:
+        case STB:
+        case LDB:
+        case STW:
+        case LDW:
+            return true;
+        case INP:
+            return ins->args[0].reg == ZERO_REGISTER && ins->args[0].value < INPUT_REGISTER_COUNT;
+        case JMP:
+            return ins->args[0].reg != ZERO_REGISTER || ins->target != NO_INSTRUCTION;
+        case BRN:
+        case BEQ:
+        case BNE:
+        case BLT:
+        case BGT:
+            return ins->args[0].reg == ZERO_REGISTER && ins->target != NO_INSTRUCTION;
+    }
+    return false;
+}
+
+static unsigned char* jitCompile(Jit* jit, VM* vm, unsigned int index) {
+    if(!canCompile(vm, index) || jit->capacity - jit->size < JIT_BLOCK_SPACE) {
+        return NULL;
+    }
+
+    Compiler compiler;
+    compiler.jit = jit;
+    compiler.vm = vm;
+    compiler.stubCount = 0;
+    compiler.pendingCycles = 0;
+
+    //Register the block first so it can jump to itself
+    jit->blocks[index] = jit->code + jit->size;
+    chainBlock(jit, index);
+
+    //Every loop passes through a block entry, so this is enough to give control back once the budget is spent
+    emitRR64(jit, 0x85, BUDGET, BUDGET); //test budget, budget
+    emitOpcode(jit, 0x0F8E); //jle
+    addStub(&compiler, jit->size, EXIT_CONTINUE(index), false);
+    emit32(jit, 0);
+
+    unsigned int i = index;
+    while(compileInstruction(&compiler, i)) {
+        i++;
+        if(i - index >= JIT_MAX_BLOCK) {
+            emitBranch(&compiler, 0xE9, i);
+            break;
+        }
+    }
+
+    //Exit stubs go after the block so the fall through path stays straight
+    for (int j = 0; j < compiler.stubCount; j++) {
+        JitStub* stub = &compiler.stubs[j];
+        patchRel32(jit, stub->site, jit->size);
+        emitExit(jit, stub->code);
+        if(stub->chain) {
+            addPatch(jit, stub->site, stub->code >> 1);
+        }
+    }
+
+    return jit->blocks[index];
+}
+
+//endregion
+
+static Jit* jitCreate(VM* vm) {
+    unsigned int capacity = (1 << 20) + vm->programLength * JIT_INSTRUCTION_SPACE;
+    void* code = mmap(NULL, capacity, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED) {
+        return NULL;
+    }
+
+    Jit* jit = malloc(sizeof(Jit));
+    jit->code = code;
+    jit->capacity = capacity;
+    jit->size = 0;
+    jit->blocks = calloc(vm->programLength + 1, sizeof(unsigned char*));
+    jit->patches = NULL;
+    jit->patchCount = 0;
+    jit->patchCapacity = 0;
+
+    pinRegisters(jit, vm);
+    emitEnter(jit);
+    emitExitStub(jit);
+    emitDispatchStub(jit, vm);
+    return jit;
+}
+
+bool jitPrepare(VM* vm) {
+    if(vm->program == NULL) {
+        return false;
+    }
+    if(vm->jit == NULL) {
+        vm->jit = jitCreate(vm);
+    }
+    return vm->jit != NULL;
+}
+
+VMStatus jitRun(VM* vm) {
+    Jit* jit = vm->jit;
+    JitEntry enter = (JitEntry)(jit->code + jit->enter);
+
+    vm->interrupt = false;
+    unsigned int index = vmResolveAddress(vm, vm->ip);
+    if(index == NO_INSTRUCTION) {
+        vm->error = "Invalid jump target";
+        vm->interrupt = true;
+        return VM_ERROR;
+    }
+
+    for(;;) {
+        if(index == vm->programLength) {
+            vm->ip = vm->program[index].address;
+            return VM_FINISHED;
+        }
+        if(vm->budget <= 0) {
+            vm->ip = vm->program[index].address;
+            return VM_RUNNING;
+        }
+
+        unsigned char* block = jit->blocks[index];
+        if(block == NULL) {
+            block = jitCompile(jit, vm, index);
+        }
+        if(block != NULL) {
+            long long budget = vm->budget;
+            unsigned int code = enter(vm, block);
+            vm->cycles += budget - vm->budget;
+            index = code >> 1;
+            if(!(code & 1)) {
+                continue;
+            }
+        }
+
+        //Anything the native code can't handle runs one instruction in the interpreter
+        vm->ip = vm->program[index].address;
+        VMStatus status = vmStep(vm);
+        if(status != VM_RUNNING) {
+            return status;
+        }
+        index = vmResolveAddress(vm, vm->ip);
+    }
+}
+
+void jitDestroy(Jit* jit) {
+    if(jit == NULL) {
+        return;
+    }
+    munmap(jit->code, jit->capacity);
+    free(jit->blocks);
+    free(jit->patches);
+    free(jit);
+}
+
+#else
+
+bool jitPrepare(VM* vm) {
+    return false;
+}
+
+VMStatus jitRun(VM* vm) {
+    return VM_ERROR;
+}
+
+void jitDestroy(Jit* jit) {
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef FAKEOS_JIT_H
+#define FAKEOS_JIT_H
+#include <stdlib.h>
+#include <stdbool.h>
+#include "asm.h"
+
+typedef struct {
+    unsigned int site; //Offset of a rel32 that should jump to the block of target
+    unsigned int target;
+} JitPatch;
+
+struct Jit {
+    unsigned char* code; //Executable memory
+    unsigned int capacity;
+    unsigned int size;
+
+    unsigned char** blocks; //Native entry point per instruction index, NULL until compiled
+    JitPatch* patches; //Branches still going through an exit stub
+    int patchCount;
+    int patchCapacity;
+
+    signed char hostRegisters[REGISTER_COUNT]; //Host register holding each guest register, -1 if it stays in memory
+
+    //Offsets of the shared stubs
+    unsigned int enter;
+    unsigned int exit;
+    unsigned int dispatch;
+};
+
+typedef struct Jit Jit;
+
+bool jitPrepare(VM* vm);
+VMStatus jitRun(VM* vm);
+void jitDestroy(Jit* jit);
+
+#endif //FAKEOS_JIT_H
@@ -1,42 +1,172 @@
 #include <stdio.h>
 #include <SDL.h>
 #include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
 #include "rendering.h"
 #include "asm.h"
 #include "parser.h"
-
-const int WIDTH = 400;
-const int HEIGHT = 300;
+#include "scheduler.h"
+#include "record.h"
+#include "heap.h"
+#include "dump.h"
+#include "input.h"
+#include "telemetry.h"
+#include "clock.h"
+
+const int WIDTH = SCREEN_WIDTH;
+const int HEIGHT = SCREEN_HEIGHT;
 const int SCALE = 2;
 
+//Everything the syscalls of one VM need, handed over through vm->host
+typedef struct {
+    const char* name; //Program file
+    SDL_Renderer* renderer; //NULL when headless
+    SDL_Texture* texture; //Streaming RGBA32 copy of the shown screen
+    Display* display; //What the texture holds
+
+    //With a window the VM runs on a thread of its own, finished frames go to the main thread
+    //through handoff and window events come back through input
+    TripleBuffer* handoff;
+    InputQueue input;
+    FrameClock clock; //Paces WAI, input wakes the VM thread early
+    InputState inputState; //Events the VM thread took from input since the last flush
+    unsigned long long inputTime; //Oldest event latched by the last flush, the next frame is the first to answer it
+    atomic_bool finished; //Set by the VM thread once the program stopped
+    VMStatus status;
+
+    //2 Screen buffers for double buffering, NULL for batch runs
+    Screen* buffers[2];
+    Screen* screen;
+    Palette* palette;
+
+    FrameDump* dump; //NULL when frames aren't dumped
+    unsigned long long frames; //Presented so far
+    unsigned long long frameLimit; //The program is stopped after this many frames, 0 for no limit
+
+    //Timings of the recent frames, recorded by whichever thread finishes a frame
+    Telemetry* telemetry;
+    unsigned long long frameStart; //When the guest started on the current frame
+    unsigned long long frameCycles; //vm->cycles at that point
+    unsigned long long lastPresent; //When the last frame was presented
+    unsigned long long lastTitle; //When the window title last showed the frame times
+    bool overlay; //Draws a frame time graph on top of the screen, toggled with F3
+} Host;
+
 //SDL
 SDL_Window *window = NULL;
-SDL_Renderer *renderer = NULL;
-
-//2 Screen buffers for double buffering
-Screen* buffers[2];
-Screen* screen = NULL;
-Palette* palette = NULL;
-
-double lastTime = 0;
-double currentTime = 0;
 
 double debuggerLastTime = 0;
 double debuggerCurrentTime = 0;
 double debuggerUpdateTime = 0;
 
+//Cycles the guest runs between two checks of the window events
+const long long CYCLES_PER_SLICE = 1000000;
+
+//Batch runs stop programs that never exit after this many cycles
+const long long BATCH_CYCLE_LIMIT = 1000000000;
+
+//Keys standing in for gamepad buttons, -1 for the rest
+int keyButton(SDL_Scancode key) {
+    switch (key) {
+        case SDL_SCANCODE_UP: return BUTTON_UP;
+        case SDL_SCANCODE_DOWN: return BUTTON_DOWN;
+        case SDL_SCANCODE_LEFT: return BUTTON_LEFT;
+        case SDL_SCANCODE_RIGHT: return BUTTON_RIGHT;
+        case SDL_SCANCODE_Z: return BUTTON_A;
+        case SDL_SCANCODE_X: return BUTTON_B;
+        case SDL_SCANCODE_RETURN: return BUTTON_START;
+        case SDL_SCANCODE_BACKSPACE: return BUTTON_SELECT;
+        default: return -1;
+    }
+}
+
+int controllerButton(Uint8 button) {
+    switch (button) {
+        case SDL_CONTROLLER_BUTTON_DPAD_UP: return BUTTON_UP;
+        case SDL_CONTROLLER_BUTTON_DPAD_DOWN: return BUTTON_DOWN;
+        case SDL_CONTROLLER_BUTTON_DPAD_LEFT: return BUTTON_LEFT;
+        case SDL_CONTROLLER_BUTTON_DPAD_RIGHT: return BUTTON_RIGHT;
+        case SDL_CONTROLLER_BUTTON_A: return BUTTON_A;
+        case SDL_CONTROLLER_BUTTON_B: return BUTTON_B;
+        case SDL_CONTROLLER_BUTTON_START: return BUTTON_START;
+        case SDL_CONTROLLER_BUTTON_BACK: return BUTTON_SELECT;
+        default: return -1;
+    }
+}
+
+//SDL stamps events in milliseconds when they are queued, which can be a whole vsync wait before
+//they are polled. Going back from now by their age keeps that wait in the measured latency.
+void forwardInput(Host* host, InputEventType type, int code, Uint32 timestamp) {
+    unsigned long long now = telemetryNow();
+    unsigned long long age = (unsigned long long)(SDL_GetTicks() - timestamp) * 1000000ull;
+    inputQueuePush(&host->input, (InputEvent){type, code, age < now ? now - age : now});
+    frameClockWake(&host->clock);
+}
+
+//Main thread, forwards window events to the VM thread
+void pollEvents(Host* host) {
+    SDL_Event e;
+    while (SDL_PollEvent(&e)) {
+        if (e.type == SDL_QUIT) {
+            forwardInput(host, INPUT_QUIT, 0, e.common.timestamp);
+        } else if (e.type == SDL_KEYDOWN && e.key.keysym.scancode == SDL_SCANCODE_F3) {
+            host->overlay = !host->overlay;
+        } else if ((e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) && !e.key.repeat) {
+            int button = keyButton(e.key.keysym.scancode);
+            if (button >= 0) {
+                forwardInput(host, e.type == SDL_KEYDOWN ? INPUT_BUTTON_DOWN : INPUT_BUTTON_UP, button, e.key.timestamp);
+            }
+            if (e.type == SDL_KEYDOWN && e.key.keysym.sym > 0 && e.key.keysym.sym < 128) {
+                forwardInput(host, INPUT_KEY, e.key.keysym.sym, e.key.timestamp);
+            }
+        } else if (e.type == SDL_CONTROLLERBUTTONDOWN || e.type == SDL_CONTROLLERBUTTONUP) {
+            int button = controllerButton(e.cbutton.button);
+            if (button >= 0) {
+                forwardInput(host, e.type == SDL_CONTROLLERBUTTONDOWN ? INPUT_BUTTON_DOWN : INPUT_BUTTON_UP, button,
+                             e.cbutton.timestamp);
+            }
+        } else if (e.type == SDL_CONTROLLERDEVICEADDED) {
+            //Closed by SDL_Quit
+            SDL_GameControllerOpen(e.cdevice.which);
+        }
+    }
+}
+
+//VM thread, takes the events so far into inputState and returns 1 when the window was closed
+int drainInput(Host* host) {
+    InputEvent event;
+    int quit = 0;
+    while (inputQueuePop(&host->input, &event)) {
+        if (event.type == INPUT_QUIT) {
+            quit = 1;
+        } else {
+            inputStateApply(&host->inputState, &event);
+        }
+    }
+    return quit;
+}
+
 int sysCallExit(VM* vm) {
     return 1;
 }
 
 int sysCallPrint(VM* vm) {
-    short address = vm->registers[1]; //Address of the string
-    short length = vm->registers[2]; //Length of the string
-    while (vm->memory[address] != 0) {
-        printf("%c", vm->memory[address]);
-        address++;
+    unsigned int address = (unsigned short)vm->registers[1]; //Address of the string
+    for (; address <= 0xFFFF; address++) {
+        const char* error = vmCheckAccess(vm, address, 1, PAGE_READ);
+        if(error != NULL) {
+            vm->error = error;
+            return -1;
+        }
+        unsigned char c = vm->memory[vmTranslate(vm, address)];
+        if(c == 0) {
+            return 0;
+        }
+        printf("%c", c);
     }
-    return 0;
+    vm->error = "String runs past the end of memory";
+    return -1;
 }
 
 int sysCallDebugRegisters(VM* vm) {
@@ -46,35 +176,120 @@ int sysCallDebugRegisters(VM* vm) {
     return 0;
 }
 
-int sysCallFlushScreen(VM* vm) {
-    SDL_Event e;
-    while (SDL_PollEvent(&e)) {
-        if (e.type == SDL_QUIT) {
-            return 1;
-        }
+//One bar per recent frame along the bottom, a frame at 60 FPS reaches the line
+#define OVERLAY_FRAMES 120
+#define OVERLAY_TARGET 16666667ull
+
+void drawOverlay(Host* host) {
+    FrameTiming timings[OVERLAY_FRAMES];
+    SDL_Rect bars[OVERLAY_FRAMES];
+    int count = telemetryRead(host->telemetry, timings, OVERLAY_FRAMES);
+    for (int i = 0; i < count; i++) {
+        unsigned long long height = timings[i].frameTime * 32 / OVERLAY_TARGET;
+        height = height > 64 ? 64 : height;
+        bars[i] = (SDL_Rect){i * 2, HEIGHT - (int)height, 2, (int)height};
     }
+    SDL_SetRenderDrawColor(host->renderer, 0, 255, 0, 255);
+    SDL_RenderFillRects(host->renderer, bars, count);
+    SDL_SetRenderDrawColor(host->renderer, 255, 0, 0, 255);
+    SDL_RenderDrawLine(host->renderer, 0, HEIGHT - 32, OVERLAY_FRAMES * 2, HEIGHT - 32);
+}
 
-    //Swap buffers
-    screen = buffers[screen == buffers[0]];
+//Once a second, so updating the title costs next to nothing
+void showFrameTimes(Host* host, unsigned long long now) {
+    if(now - host->lastTitle < 1000000000ull) {
+        return;
+    }
+    host->lastTitle = now;
+    TelemetrySummary summary = telemetrySummarize(host->telemetry, 0);
+    char title[128];
+    snprintf(title, sizeof(title), "Fake OS - frame p50 %.1f ms, p99 %.1f ms, max %.1f ms",
+             summary.frameTime.p50 / 1e6, summary.frameTime.p99 / 1e6, summary.frameTime.max / 1e6);
+    SDL_SetWindowTitle(window, title);
+}
 
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+//Main thread, timing comes from the VM thread and gets the present side filled in
+void presentWindow(Host* host, Screen* screen, FrameTiming* timing) {
+    unsigned long long start = telemetryNow();
+
+    //Only the part that differs from the last frame is converted and uploaded
+    Rect changed;
+    if(displayUpdate(host->display, screen, host->palette, &changed)) {
+        Display* display = host->display;
+        SDL_Rect rect = {changed.x, changed.y, changed.width, changed.height};
+        SDL_UpdateTexture(host->texture, &rect, display->pixels + changed.y * display->width + changed.x,
+                          display->width * (int)sizeof(unsigned int));
+    }
+    unsigned long long converted = telemetryNow();
 
-    for (int i = 0; i < screen->width * screen->height; i++) {
-        Color color = palette->colors[screen->buffer[i]];
-        SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, 255);
-        SDL_RenderDrawPoint(renderer, i % screen->width, i / screen->width);
+    SDL_RenderCopy(host->renderer, host->texture, NULL, NULL);
+    if(host->overlay) {
+        drawOverlay(host);
     }
+    SDL_RenderPresent(host->renderer);
+    unsigned long long presented = telemetryNow();
+
+    timing->convertTime = converted - start;
+    timing->presentTime = presented - converted;
+    timing->frameTime = host->lastPresent > 0 ? presented - host->lastPresent : 0;
+    timing->inputLatency = timing->inputTime != 0 ? presented - timing->inputTime : 0;
+    host->lastPresent = presented;
+    telemetryRecord(host->telemetry, timing);
+    showFrameTimes(host, presented);
+}
 
-    SDL_RenderPresent(renderer);
+int sysCallFlushScreen(VM* vm) {
+    Host* host = vm->host;
+    if(host->buffers[0] == NULL) {
+        return 0;
+    }
+    if(drainInput(host)) {
+        return 1;
+    }
 
-    currentTime = SDL_GetTicks();
-    double delta = currentTime - lastTime;
-    lastTime = currentTime;
+    //Swap buffers
+    Screen* screen = host->buffers[host->screen == host->buffers[0]];
+    host->screen = screen;
+
+    unsigned long long now = telemetryNow();
+    FrameTiming timing = {host->frames, vm->cycles - host->frameCycles, now - host->frameStart};
+    timing.inputTime = host->inputTime;
+
+    //The main thread presents it whenever it gets to it. Both buffers keep track of where they differ from
+    //the last frame handed over, so the other one is now also off by what changed in this one.
+    if(host->handoff != NULL) {
+        screenMarkSpansDirty(host->buffers[screen == host->buffers[0]], screen->dirty);
+        tripleBufferPublish(host->handoff, screen, &timing);
+    }
+    if(host->dump != NULL) {
+        frameDumpWrite(host->dump, screen, host->palette);
+    }
+    host->frames++;
+
+    //Without a window this thread finishes the frame, writing the dump counts as converting it
+    if(host->handoff == NULL && host->telemetry != NULL) {
+        unsigned long long finished = telemetryNow();
+        timing.convertTime = finished - now;
+        timing.frameTime = host->lastPresent > 0 ? finished - host->lastPresent : 0;
+        host->lastPresent = finished;
+        telemetryRecord(host->telemetry, &timing);
+    }
+    host->frameStart = telemetryNow();
+    host->frameCycles = vm->cycles;
 
-    printf("FPS: %f\n", 1000.0 / delta);
+    //The program sees the input of the frame that just ended until its next flush. This runs
+    //inside a recorded syscall, so recordings pick the registers up with the rest of the state.
+    host->inputTime = inputStateLatch(&host->inputState, vm->input);
 
-    vm->bp = screen == buffers[0] ? 0 : 1;
-    return 0;
+    vm->bp = screen == host->buffers[0] ? 0 : 1;
+    return host->frameLimit > 0 && host->frames >= host->frameLimit;
+}
+
+void registerSysCalls(VM* vm) {
+    vmSysCall(vm, sysCallExit);
+    vmSysCall(vm, sysCallPrint);
+    vmSysCallRecorded(vm, sysCallFlushScreen);
+    vmSysCall(vm, sysCallDebugRegisters);
 }
 
 //region Debugger
@@ -128,9 +343,221 @@ void manageDebugger(VM* vm) {
 
 //endregion
 
-int main(void) {
+//region Batch
+
+void batchFinished(VM* vm, VMStatus status) {
+    Host* host = vm->host;
+    if(status == VM_ERROR) {
+        printf("%s: error: %s at byte %d\n", host->name, vm->error, vm->ip);
+    } else if(status == VM_RUNNING || status == VM_WAITING) {
+        printf("%s: stopped after %llu cycles\n", host->name, vm->cycles);
+    } else {
+        printf("%s: exited with code %d\n", host->name, vm->registers[0]);
+    }
+    HeapStats heap = vmHeapStats(vm);
+    printf("%s: heap peak %d bytes, %llu allocations, %d%% fragmented\n",
+           host->name, heap.peakBytes, heap.allocationCount, heap.fragmentation);
+}
+
+//Runs every program headless across all cores
+int runBatch(int count, char** files) {
+    Scheduler* scheduler = schedulerCreate(0, CYCLES_PER_SLICE);
+    scheduler->cycleLimit = BATCH_CYCLE_LIMIT;
+    scheduler->finished = batchFinished;
+
+    VM** vms = malloc(sizeof(VM*) * count);
+    Host* hosts = calloc(count, sizeof(Host));
+    int loaded = 0;
+    //Every source is assembled in the same arena, it only grows to fit the biggest one
+    Arena arena;
+    arenaInit(&arena, 0);
+    for (int i = 0; i < count; i++) {
+        Chunk* program = parseFileInArena(files[i], &arena);
+        arenaReset(&arena);
+        if(program == NULL) {
+            continue;
+        }
+        VM* vm = vmCreate();
+        hosts[loaded].name = files[i];
+        vm->host = &hosts[loaded];
+        registerSysCalls(vm);
+        vmLoadProgram(vm, program);
+        chunkDestroy(program);
+        schedulerAdd(scheduler, vm);
+        vms[loaded] = vm;
+        loaded++;
+    }
+    arenaDestroy(&arena);
+
+    schedulerRun(scheduler);
+
+    for (int i = 0; i < loaded; i++) {
+        vmDestroy(vms[i]);
+    }
+    free(vms);
+    free(hosts);
+    schedulerDestroy(scheduler);
+    return 0;
+}
+
+//Repeats a recorded run headless and as fast as possible, without screens
+int runReplay(const char* path, const char* name) {
+    Host host = {0};
+    host.name = name;
+    Chunk* program = parseFile(host.name);
+    if(program == NULL) {
+        return 1;
+    }
+
+    VM* vm = vmCreate();
+    vm->host = &host;
+    registerSysCalls(vm);
+    vmLoadProgram(vm, program);
+    chunkDestroy(program);
+    if(recorderOpen(vm, path, RECORD_REPLAYING) == NULL) {
+        vmDestroy(vm);
+        return 1;
+    }
+
+    int result = vmRun(vm);
+    printf("Program exited with code %d\n", result);
+    if(vm->recorder->error != NULL) {
+        printf("Replay stopped: %s\n    at byte: %d\n", vm->recorder->error, vm->ip);
+    } else if(result == -1) {
+        printf("Error: %s\n    at byte: %d\n", vm->error, vm->ip);
+    }
+
+    vmDestroy(vm);
+    return 0;
+}
+
+static double hostSeconds() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return (double)time.tv_sec + time.tv_nsec / 1e9;
+}
+
+//Runs with screens but without SDL video and as fast as possible.
+//Options: --frames <count> to stop after that many frames, --dump <raw|ppm|hash> <path>,
+//--telemetry <path> to export the frame timings, as CSV for a .csv path, --record <path> to record the run
+int runHeadless(int argc, char** argv) {
+    Host host = {0};
+    host.name = "programs/test.asm";
+    const char* dumpPath = NULL;
+    const char* telemetryPath = NULL;
+    const char* recording = NULL;
+    FrameDumpFormat dumpFormat = DUMP_HASH;
+    for (int i = 0; i < argc; i++) {
+        if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            host.frameLimit = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--dump") == 0 && i + 2 < argc && frameDumpParseFormat(argv[i + 1], &dumpFormat)) {
+            dumpPath = argv[i + 2];
+            i += 2;
+        } else if(strcmp(argv[i], "--telemetry") == 0 && i + 1 < argc) {
+            telemetryPath = argv[++i];
+        } else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recording = argv[++i];
+        } else {
+            host.name = argv[i];
+        }
+    }
+
+    Chunk* program = parseFile(host.name);
+    if(program == NULL) {
+        return 1;
+    }
+    if(dumpPath != NULL) {
+        host.dump = frameDumpOpen(dumpPath, dumpFormat);
+        if(host.dump == NULL) {
+            chunkDestroy(program);
+            return 1;
+        }
+    }
+    host.buffers[0] = screenCreate(WIDTH, HEIGHT);
+    host.buffers[1] = screenCreate(WIDTH, HEIGHT);
+    host.screen = host.buffers[0];
+    host.palette = paletteCreate();
+    host.telemetry = telemetryCreate();
+    inputQueueInit(&host.input);
+
+    VM* vm = vmCreate();
+    vm->host = &host;
+    vm->buffers[0] = host.buffers[0];
+    vm->buffers[1] = host.buffers[1];
+    registerSysCalls(vm);
+    host.frameStart = telemetryNow();
+    sysCallFlushScreen(vm);
+    vmLoadProgram(vm, program);
+    chunkDestroy(program);
+    if(recording != NULL && recorderOpen(vm, recording, RECORD_RECORDING) == NULL) {
+        vmDestroy(vm);
+        return 1;
+    }
+
+    double start = hostSeconds();
+    int result = vmRun(vm);
+    double elapsed = hostSeconds() - start;
+
+    printf("Program exited with code %d\n", result);
+    if(result == -1) {
+        printf("Error: %s\n    at byte: %d\n", vm->error, vm->ip);
+    }
+    printf("%llu frames, %llu cycles in %.3f s: %.1f frames/s, %.1f Mcycles/s\n", host.frames, vm->cycles, elapsed,
+           elapsed > 0 ? host.frames / elapsed : 0, elapsed > 0 ? vm->cycles / elapsed / 1e6 : 0);
+    telemetryPrintSummary(host.telemetry, stdout);
+    if(telemetryPath != NULL) {
+        telemetryExport(host.telemetry, telemetryPath);
+    }
+    recorderClose(vm);
+
+    if(host.dump != NULL) {
+        frameDumpClose(host.dump);
+    }
+    telemetryDestroy(host.telemetry);
+    vmDestroy(vm);
+    return 0;
+}
+
+//endregion
+
+//Run in slices so a program that never flushes the screen still notices the window closing.
+//A program waiting on WAI sleeps here until the next frame.
+void* runVMThread(void* arg) {
+    VM* vm = arg;
+    Host* host = vm->host;
+    VMStatus status;
+    do {
+        status = vmRunFor(vm, CYCLES_PER_SLICE);
+        if(status == VM_WAITING) {
+            //Time asleep doesn't count as time the guest ran
+            host->frameStart += frameClockWait(&host->clock);
+        }
+    } while ((status == VM_RUNNING || status == VM_WAITING) && !drainInput(host));
+    host->status = status;
+    atomic_store(&host->finished, true);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    if(argc > 2 && strcmp(argv[1], "--batch") == 0) {
+        return runBatch(argc - 2, argv + 2);
+    }
+    if(argc > 2 && strcmp(argv[1], "--replay") == 0) {
+        return runReplay(argv[2], argc > 3 ? argv[3] : "programs/test.asm");
+    }
+    if(argc > 1 && strcmp(argv[1], "--headless") == 0) {
+        return runHeadless(argc - 2, argv + 2);
+    }
+    const char* recording = argc > 2 && strcmp(argv[1], "--record") == 0 ? argv[2] : NULL;
+    const char* telemetryPath = NULL;
+    for (int i = 1; i + 1 < argc; i++) {
+        if(strcmp(argv[i], "--telemetry") == 0) {
+            telemetryPath = argv[i + 1];
+        }
+    }
+
     //region SDL setup
-    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMECONTROLLER) != 0) {
         fprintf(stderr, "SDL_Init Error: %s\n", SDL_GetError());
         return 1;
     }
@@ -141,26 +568,41 @@ int main(void) {
         return 1;
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
-    if (renderer == NULL) {
+    Host host = {0};
+    host.name = "programs/test.asm";
+    host.renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+    if (host.renderer == NULL) {
         fprintf(stderr, "SDL_CreateRenderer Error: %s\n", SDL_GetError());
         return 1;
     }
 
-    SDL_RenderSetScale(renderer, SCALE, SCALE);
+    SDL_RenderSetScale(host.renderer, SCALE, SCALE);
 
-    //endregion
-    buffers[0] = screenCreate(WIDTH, HEIGHT);
-    buffers[1] = screenCreate(WIDTH, HEIGHT);
+    host.texture = SDL_CreateTexture(host.renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
+    if (host.texture == NULL) {
+        fprintf(stderr, "SDL_CreateTexture Error: %s\n", SDL_GetError());
+        return 1;
+    }
 
-    screen = buffers[0];
+    //endregion
+    host.buffers[0] = screenCreate(WIDTH, HEIGHT);
+    host.buffers[1] = screenCreate(WIDTH, HEIGHT);
 
-    palette = paletteCreate();
+    host.screen = host.buffers[0];
+    host.display = displayCreate(WIDTH, HEIGHT);
+    host.handoff = tripleBufferCreate(WIDTH, HEIGHT);
+    inputQueueInit(&host.input);
+    frameClockInit(&host.clock, FRAME_PERIOD);
+    atomic_init(&host.finished, false);
 
-    lastTime = SDL_GetTicks();
+    host.palette = paletteCreate();
+    host.telemetry = telemetryCreate();
 
 //region VM setup
-    Chunk* program = parseFile("programs/test.asm");
+    Chunk* program = parseFile(host.name);
+    if(program == NULL) {
+        return 1;
+    }
 
     //Debug the program to a file
     FILE* file = fopen("programs/test.bin", "wb");
@@ -170,30 +612,62 @@ int main(void) {
     VM* vm = vmCreate();
 
     //vm->debugger = manageDebugger;
+    //vm->useJit = true;
 
-    vm->buffers[0] = buffers[0];
-    vm->buffers[1] = buffers[1];
+    vm->host = &host;
+    vm->buffers[0] = host.buffers[0];
+    vm->buffers[1] = host.buffers[1];
 
-    vmSysCall(vm, sysCallExit);
-    vmSysCall(vm, sysCallPrint);
-    vmSysCall(vm, sysCallFlushScreen);
-    vmSysCall(vm, sysCallDebugRegisters);
+    registerSysCalls(vm);
 
+    host.frameStart = telemetryNow();
     sysCallFlushScreen(vm);
 
     vmLoadProgram(vm, program);
 
+    if(recording != NULL && recorderOpen(vm, recording, RECORD_RECORDING) == NULL) {
+        return 1;
+    }
 
-    int result = vmRun(vm);
+    pthread_t vmThread;
+    pthread_create(&vmThread, NULL, runVMThread, vm);
+
+    //The main thread owns the window, it presents the newest frame and forwards events until the VM stops
+    //Reading finished first makes sure the last frame gets presented
+    bool finished = false;
+    while (!finished) {
+        finished = atomic_load(&host.finished);
+        pollEvents(&host);
+        FrameTiming timing;
+        Screen* frame = tripleBufferTake(host.handoff, &timing);
+        if (frame != NULL) {
+            presentWindow(&host, frame, &timing);
+        } else if (!finished) {
+            SDL_Delay(1);
+        }
+    }
+    pthread_join(vmThread, NULL);
+
+    int result = host.status == VM_ERROR ? -1 : vm->registers[0];
 
     printf("Program exited with code %d\n", result);
 
     if(result == -1) {
         printf("Error: %s\n    at byte: %d", vm->error, vm->ip);
     }
+    recorderClose(vm);
 //endregion
 
-    SDL_DestroyRenderer(renderer);
+    telemetryPrintSummary(host.telemetry, stdout);
+    if(telemetryPath != NULL) {
+        telemetryExport(host.telemetry, telemetryPath);
+    }
+    telemetryDestroy(host.telemetry);
+    frameClockDestroy(&host.clock);
+    tripleBufferDestroy(host.handoff);
+    displayDestroy(host.display);
+    SDL_DestroyTexture(host.texture);
+    SDL_DestroyRenderer(host.renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
 
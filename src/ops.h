@@ -32,7 +32,37 @@ typedef enum {
     //Extended opcodes
     //Video memory
     SPX, //Write pixel to the screen buffer
-    CLS, //Clear the screen buffer
+    CLS, //Clear the screen buffer, or draw the tilemap when there is one
+
+    //Bulk memory
+    STW, //Store a 16 bit word, low byte first
+    LDW, //Load a 16 bit word
+    CPY, //Copy a block, the ranges may overlap
+    FIL, //Fill a block with a byte
+    BNK, //Switch the bank shown in the window at BANK_WINDOW
+
+    //Sprites
+    VLD, //Copy a block of memory into video memory
+    SPD, //Define a sprite from a descriptor in memory
+    SPR, //Draw a sprite to the screen buffer
+
+    //Drawing, clipped to the screen buffer
+    COL, //Set the drawing color
+    PEN, //Move the pen
+    HLN, //Draw a horizontal span
+    LIN, //Draw a line from the pen, the pen moves to its end
+    REC, //Fill the rectangle between the pen and a corner
+    BOX, //Outline the rectangle between the pen and a corner
+
+    //Tilemap
+    TIL, //Set the tilemap from a descriptor in memory
+    SCR, //Scroll the tilemap
+
+    //Frame pacing
+    WAI, //Wait for the next frame or for input
+
+    //Input
+    INP, //Read an input register
 } OpCode;
 
 typedef enum {
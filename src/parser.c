@@ -1,44 +1,128 @@
 #include "parser.h"
 
-LabelTable* labelTableCreate() {
-    LabelTable* table = malloc(sizeof(LabelTable));
-    table->labels = malloc(1);
+//region Labels
+
+#define LABEL_SLOTS 64 //Starting size of the hash table, power of two
+
+LabelTable* labelTableCreate(Arena* arena) {
+    LabelTable* table = arenaAlloc(arena, sizeof(LabelTable));
+    table->labels = NULL;
     table->count = 0;
-    table->capacity = 1;
+    table->capacity = 0;
+    table->slots = arenaAlloc(arena, LABEL_SLOTS * sizeof(int));
+    memset(table->slots, 0, LABEL_SLOTS * sizeof(int));
+    table->slotCount = LABEL_SLOTS;
+    table->arena = arena;
     return table;
 }
 
-void labelTableAdd(LabelTable* table, Label label) {
-    table->labels = realloc(table->labels, sizeof(Label) * (table->count + 1));
-    table->labels[table->count] = label;
-    table->count++;
+//Arrays in an arena grow by moving to a bigger allocation, the old one goes with the arena
+static void* arenaGrow(Arena* arena, void* array, int count, int* capacity, size_t size) {
+    if(count < *capacity) {
+        return array;
+    }
+    *capacity = *capacity > 0 ? *capacity * 2 : 16;
+    void* grown = arenaAlloc(arena, *capacity * size);
+    if(count > 0) {
+        memcpy(grown, array, count * size);
+    }
+    return grown;
 }
 
-Label* labelTableGet(LabelTable* table, const char* name) {
-    for (int i = 0; i < table->count; i++) {
-        if(strcmp(table->labels[i].name, name) == 0) {
-            return &table->labels[i];
+//FNV-1a of the lowercase name, label names don't care about case like the opcodes
+static unsigned int hashName(const char* name, int length) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)tolower((unsigned char)name[i])) * 16777619u;
+    }
+    return hash;
+}
+
+static bool sameName(const Label* label, const char* name, int length) {
+    if(label->length != length) {
+        return false;
+    }
+    for (int i = 0; i < length; i++) {
+        if(label->name[i] != tolower((unsigned char)name[i])) {
+            return false;
         }
     }
-    return NULL;
+    return true;
 }
 
-bool labelTableContains(LabelTable* table, const char* name) {
+//Slot holding the name, or the empty slot where it would go
+static int labelTableSlot(LabelTable* table, unsigned int hash, const char* name, int length) {
+    int mask = table->slotCount - 1;
+    for (int slot = (int)(hash & mask);; slot = (slot + 1) & mask) {
+        int index = table->slots[slot] - 1;
+        if(index < 0 || (table->labels[index].hash == hash && sameName(&table->labels[index], name, length))) {
+            return slot;
+        }
+    }
+}
+
+//Kept at most half full, so probe runs stay short
+static void labelTableGrow(LabelTable* table) {
+    int slotCount = table->slotCount * 2;
+    int* slots = arenaAlloc(table->arena, slotCount * sizeof(int));
+    memset(slots, 0, slotCount * sizeof(int));
     for (int i = 0; i < table->count; i++) {
-        if(strcmp(table->labels[i].name, name) == 0) {
-            return true;
+        int slot = (int)(table->labels[i].hash & (slotCount - 1));
+        while(slots[slot] != 0) {
+            slot = (slot + 1) & (slotCount - 1);
         }
+        slots[slot] = i + 1;
     }
-    return false;
+    table->slots = slots;
+    table->slotCount = slotCount;
 }
 
-void labelTableDestroy(LabelTable* table) {
-    free(table->labels);
-    free(table);
+int labelTableFind(LabelTable* table, const char* name, int length) {
+    int slot = labelTableSlot(table, hashName(name, length), name, length);
+    return table->slots[slot] - 1;
 }
 
-Chunk* parseFile(const char* filename) {
-    FILE* file = fopen(filename, "r");
+int labelTableIntern(LabelTable* table, const char* name, int length, int line) {
+    unsigned int hash = hashName(name, length);
+    int slot = labelTableSlot(table, hash, name, length);
+    if(table->slots[slot] != 0) {
+        return table->slots[slot] - 1;
+    }
+
+    char* interned = arenaAlloc(table->arena, length + 1);
+    for (int i = 0; i < length; i++) {
+        interned[i] = (char)tolower((unsigned char)name[i]);
+    }
+    interned[length] = '\0';
+
+    table->labels = arenaGrow(table->arena, table->labels, table->count, &table->capacity, sizeof(Label));
+    table->labels[table->count] = (Label){interned, length, hash, LABEL_UNDEFINED, line};
+    table->slots[slot] = ++table->count;
+    if(table->count * 2 > table->slotCount) {
+        labelTableGrow(table);
+    }
+    return table->count - 1;
+}
+
+//endregion
+
+//Everything one source needs while it is assembled, lives in the arena
+typedef struct {
+    Chunk* chunk;
+    LabelTable* labels;
+    Fixup* fixups;
+    int fixupCount;
+    int fixupCapacity;
+    Arena* arena;
+    int line;
+    int mnemonicLines[256]; //Line each opcode was first written by name on, 0 for never
+    bool failed; //An error was printed, there is no chunk
+} Parser;
+
+//Reads the whole file into the arena and assembles it. Nothing but the chunk outlives the arena,
+//so assembling many files with one arena and resetting it in between reuses the same memory.
+Chunk* parseFileInArena(const char* filename, Arena* arena) {
+    FILE* file = fopen(filename, "rb");
     if (file == NULL) {
         printf("Error opening file\n");
         return NULL;
@@ -48,78 +132,32 @@ Chunk* parseFile(const char* filename) {
     long fileSize = ftell(file);
     fseek(file, 0, SEEK_SET);
 
-    char* buffer = malloc(fileSize + 1);
-    fread(buffer, 1, fileSize, file);
+    char* buffer = arenaAlloc(arena, fileSize > 0 ? fileSize : 1);
+    size_t read = fread(buffer, 1, fileSize > 0 ? fileSize : 0, file);
     fclose(file);
 
-    Chunk* chunk = parseText(buffer);
+    return parseSource(buffer, read, arena);
+}
+
+Chunk* parseFile(const char* filename) {
+    Arena arena;
+    arenaInit(&arena, 0);
+    Chunk* chunk = parseFileInArena(filename, &arena);
+    arenaDestroy(&arena);
     return chunk;
 }
 
 Chunk* parseText(char* string) {
-    int count = 0;
-    char** lines = splitString(string, "\n", &count);
-
-    LabelTable* labels = labelTableCreate();
-
-    //First find all the labels
-    int location = 0;
-    for (int i = 0; i < count; i++) {
-        char *line = lines[i];
-        int len = strlen(line);
-        if (len == 0) {
-            continue;
-        }
-        if (line[len - 1] == ':') {
-            Label label;
-            label.name = malloc(len);
-            strncpy(label.name, line, len - 1);
-            label.location = location;
-            labelTableAdd(labels, label);
-            lines[i] = "";
-            continue;
-        }
-        int lineCount = 0;
-        splitString(line, " ", &lineCount);
-        location += lineCount;
-    }
-
-
-    Chunk* chunk = chunkCreate();
-    for (int i = 0; i < count; i++) {
-        char* line = lines[i];
-        int lineCount = 0;
-        char** tokens = splitString(lines[i], " ", &lineCount);
-        for (int j = 0; j < lineCount; j++) {
-            if(parseOpcode(chunk, labels, tokens[j]) == 1) {
-                break;
-            }
-        }
-    }
-
+    Arena arena;
+    arenaInit(&arena, 0);
+    Chunk* chunk = parseSource(string, strlen(string), &arena);
+    arenaDestroy(&arena);
     return chunk;
 }
 
-int parseOpcode(Chunk* chunk, LabelTable* labels, char* text)
-{
-    //Convert text to lowercase
-    for (int i = 0; text[i]; i++) {
-        text[i] = tolower(text[i]);
-    }
-    if(labelTableContains(labels, text)) {
-        short location = labelTableGet(labels, text)->location;
-        chunkWriteByte(chunk, IMS);
-        chunkWriteByte(chunk, location & 0xFF);
-        chunkWriteByte(chunk, location >> 8);
-        return 0;
-    }
+//Three letter opcodes, text is lowercase. Writes nothing for anything else.
+static void parseMnemonic(Chunk* chunk, const char* text) {
     switch (text[0]) {
-        case '/': {
-            if(strcmp(text, "/") == 0) {
-                return 1;
-            }
-            break;
-        }
         case 'a': {
             if(strcmp(text, "add") == 0) {
                 chunkWriteByte(chunk, ADD);
@@ -135,6 +173,16 @@ int parseOpcode(Chunk* chunk, LabelTable* labels, char* text)
                 chunkWriteByte(chunk, SUB);
             } else if(strcmp(text, "stb") == 0) {
                 chunkWriteByte(chunk, STB);
+            } else if(strcmp(text, "stw") == 0) {
+                chunkWriteByte(chunk, STW);
+            } else if(strcmp(text, "spx") == 0) {
+                chunkWriteByte(chunk, SPX);
+            } else if(strcmp(text, "spd") == 0) {
+                chunkWriteByte(chunk, SPD);
+            } else if(strcmp(text, "spr") == 0) {
+                chunkWriteByte(chunk, SPR);
+            } else if(strcmp(text, "scr") == 0) {
+                chunkWriteByte(chunk, SCR);
             }
             break;
         }
@@ -169,12 +217,20 @@ int parseOpcode(Chunk* chunk, LabelTable* labels, char* text)
         case 'c': {
             if(strcmp(text, "cmp") == 0) {
                 chunkWriteByte(chunk, CMP);
+            } else if(strcmp(text, "cpy") == 0) {
+                chunkWriteByte(chunk, CPY);
+            } else if(strcmp(text, "cls") == 0) {
+                chunkWriteByte(chunk, CLS);
+            } else if(strcmp(text, "col") == 0) {
+                chunkWriteByte(chunk, COL);
             }
             break;
         }
         case 'r': {
             if(strcmp(text, "ret") == 0) {
                 chunkWriteByte(chunk, RET);
+            } else if(strcmp(text, "rec") == 0) {
+                chunkWriteByte(chunk, REC);
             }
             break;
         }
@@ -189,6 +245,56 @@ int parseOpcode(Chunk* chunk, LabelTable* labels, char* text)
                 chunkWriteByte(chunk, BLT);
             } else if(strcmp(text, "bgt") == 0) {
                 chunkWriteByte(chunk, BGT);
+            } else if(strcmp(text, "bnk") == 0) {
+                chunkWriteByte(chunk, BNK);
+            } else if(strcmp(text, "box") == 0) {
+                chunkWriteByte(chunk, BOX);
+            }
+            break;
+        }
+        case 'l': {
+            if(strcmp(text, "ldb") == 0) {
+                chunkWriteByte(chunk, LDB);
+            } else if(strcmp(text, "ldw") == 0) {
+                chunkWriteByte(chunk, LDW);
+            } else if(strcmp(text, "lin") == 0) {
+                chunkWriteByte(chunk, LIN);
+            }
+            break;
+        }
+        case 'p': {
+            if(strcmp(text, "pen") == 0) {
+                chunkWriteByte(chunk, PEN);
+            }
+            break;
+        }
+        case 'h': {
+            if(strcmp(text, "hln") == 0) {
+                chunkWriteByte(chunk, HLN);
+            }
+            break;
+        }
+        case 't': {
+            if(strcmp(text, "til") == 0) {
+                chunkWriteByte(chunk, TIL);
+            }
+            break;
+        }
+        case 'v': {
+            if(strcmp(text, "vld") == 0) {
+                chunkWriteByte(chunk, VLD);
+            }
+            break;
+        }
+        case 'i': {
+            if(strcmp(text, "inp") == 0) {
+                chunkWriteByte(chunk, INP);
+            }
+            break;
+        }
+        case 'w': {
+            if(strcmp(text, "wai") == 0) {
+                chunkWriteByte(chunk, WAI);
             }
             break;
         }
@@ -201,46 +307,206 @@ int parseOpcode(Chunk* chunk, LabelTable* labels, char* text)
         case 'f': {
             if(strcmp(text, "fre") == 0) {
                 chunkWriteByte(chunk, FRE);
+            } else if(strcmp(text, "fil") == 0) {
+                chunkWriteByte(chunk, FIL);
             }
             break;
         }
+    }
+}
+
+//Like atoi, the digits after an optional sign
+static int parseNumber(const char* text, int length) {
+    int i = 0;
+    bool negative = false;
+    if(i < length && (text[i] == '-' || text[i] == '+')) {
+        negative = text[i] == '-';
+        i++;
+    }
+    int value = 0;
+    for (; i < length && text[i] >= '0' && text[i] <= '9'; i++) {
+        value = value * 10 + (text[i] - '0');
+    }
+    return negative ? -value : value;
+}
+
+//Writes the opcode if the token is one, in any case
+static bool parseMnemonicToken(Chunk* chunk, const char* token, int length) {
+    if(length > 3) {
+        return false;
+    }
+    char text[4];
+    for (int i = 0; i < length; i++) {
+        text[i] = (char)tolower((unsigned char)token[i]);
+    }
+    text[length] = '\0';
+    int size = chunk->size;
+    parseMnemonic(chunk, text);
+    return chunk->size != size;
+}
+
+static void writeAddress(Chunk* chunk, unsigned short location) {
+    chunkWriteByte(chunk, IMS);
+    chunkWriteByte(chunk, location & 0xFF);
+    chunkWriteByte(chunk, location >> 8);
+}
+
+static void parseToken(Parser* parser, const char* token, int length) {
+    Chunk* chunk = parser->chunk;
+    switch (token[0]) {
         case '#': {
-            short value = atoi(text+1);
+            short value = (short)parseNumber(token + 1, length - 1);
             chunkWriteByte(chunk, IMS);
             chunkWriteByte(chunk, value & 0xFF);
             chunkWriteByte(chunk, value >> 8);
-            break;
+            return;
         }
-        case '$': {
+        case '$':
             chunkWriteByte(chunk, IMB);
-            chunkWriteByte(chunk, (unsigned char)atoi(text+1));
-            break;
-        }
-        case '@': {
+            chunkWriteByte(chunk, (unsigned char)parseNumber(token + 1, length - 1));
+            return;
+        case '@':
             chunkWriteByte(chunk, REG);
-            chunkWriteByte(chunk, (unsigned char)atoi(text+1));
-            break;
+            chunkWriteByte(chunk, (unsigned char)parseNumber(token + 1, length - 1));
+            return;
+    }
+
+    //Labels come first, so one can be named like an opcode
+    LabelTable* labels = parser->labels;
+    int label = labelTableFind(labels, token, length);
+    if(label >= 0 && labels->labels[label].location != LABEL_UNDEFINED) {
+        writeAddress(chunk, labels->labels[label].location);
+        return;
+    }
+
+    int size = chunk->size;
+    if(parseMnemonicToken(chunk, token, length)) {
+        if(parser->mnemonicLines[chunk->data[size]] == 0) {
+            parser->mnemonicLines[chunk->data[size]] = parser->line;
         }
+        return;
     }
-    return 0;
+
+    //Anything else has to be a label defined further down
+    if(label < 0) {
+        label = labelTableIntern(labels, token, length, parser->line);
+    }
+    parser->fixups = arenaGrow(parser->arena, parser->fixups, parser->fixupCount, &parser->fixupCapacity, sizeof(Fixup));
+    parser->fixups[parser->fixupCount++] = (Fixup){label, chunk->size + 1, parser->line};
+    writeAddress(chunk, 0);
+}
+
+//Opcode the label would have been taken for, -1 if its name isn't one
+static int mnemonicOpcode(Chunk* chunk, const char* name, int length) {
+    int size = chunk->size;
+    if(!parseMnemonicToken(chunk, name, length)) {
+        return -1;
+    }
+    int opcode = chunk->data[size];
+    chunk->size = size;
+    return opcode;
+}
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
 }
 
-char** splitString(char* string, char* delimiter, int* count) {
-    char** result = malloc(1);
-    int resultCount = 0;
+static void parseLine(Parser* parser, const char* start, const char* end) {
+    //A token starting with a slash comments out the rest of the line, / comment and //comment alike
+    for (const char* c = start; c < end; c++) {
+        if(*c == '/' && (c == start || isSpace(c[-1]))) {
+            end = c;
+            break;
+        }
+    }
+    while(start < end && isSpace(*start)) {
+        start++;
+    }
+    while(end > start && isSpace(end[-1])) {
+        end--;
+    }
+    if(start == end) {
+        return;
+    }
 
-    char* stringCopy = malloc(strlen(string) + 1);
-    strcpy(stringCopy, string);
+    //A line ending in a colon names the address of whatever comes next
+    if(end[-1] == ':') {
+        int length = (int)(end - 1 - start);
+        int index = labelTableIntern(parser->labels, start, length, parser->line);
+        Label* label = &parser->labels->labels[index];
+        if(label->location != LABEL_UNDEFINED) {
+            printf("Label %s on line %d was already defined on line %d\n", label->name, parser->line, label->line);
+            parser->failed = true;
+            return;
+        }
+        //Labels win over opcodes, but there is only one pass. An earlier use of the name already
+        //went out as the opcode and can't become an address anymore.
+        int opcode = mnemonicOpcode(parser->chunk, start, length);
+        if(opcode >= 0 && parser->mnemonicLines[opcode] != 0) {
+            printf("Label %s on line %d was already used as an instruction on line %d\n", label->name, parser->line,
+                   parser->mnemonicLines[opcode]);
+            parser->failed = true;
+            return;
+        }
+        label->location = parser->chunk->size;
+        label->line = parser->line;
+        return;
+    }
 
-    char* token = strtok(stringCopy, delimiter);
-    while (token != NULL) {
-        result = realloc(result, sizeof(char*) * (resultCount + 1));
-        result[resultCount] = token;
-        resultCount++;
-        token = strtok(NULL, delimiter);
+    const char* cursor = start;
+    while(cursor < end) {
+        const char* token = cursor;
+        while(cursor < end && !isSpace(*cursor)) {
+            cursor++;
+        }
+        parseToken(parser, token, (int)(cursor - token));
+        while(cursor < end && isSpace(*cursor)) {
+            cursor++;
+        }
     }
+}
+
+//Assembles in one pass over the source. Tokens point into it, so it has to stay alive until
+//this returns. Labels used before their definition are patched at the end, in one go.
+Chunk* parseSource(const char* source, size_t length, Arena* arena) {
+    Parser parser;
+    //A token takes at least 2 characters with its separator and writes at most 3 bytes
+    parser.chunk = chunkCreateWithCapacity((int)(length + length / 2 + 4));
+    parser.labels = labelTableCreate(arena);
+    parser.fixups = NULL;
+    parser.fixupCount = 0;
+    parser.fixupCapacity = 0;
+    parser.arena = arena;
+    parser.line = 1;
+    memset(parser.mnemonicLines, 0, sizeof(parser.mnemonicLines));
+    parser.failed = false;
 
+    const char* cursor = source;
+    const char* end = source + length;
+    while(cursor < end) {
+        const char* lineEnd = memchr(cursor, '\n', end - cursor);
+        if(lineEnd == NULL) {
+            lineEnd = end;
+        }
+        parseLine(&parser, cursor, lineEnd);
+        cursor = lineEnd + 1;
+        parser.line++;
+    }
 
-    *count = resultCount;
-    return result;
-}
\ No newline at end of file
+    for (int i = 0; i < parser.fixupCount && !parser.failed; i++) {
+        Fixup* fixup = &parser.fixups[i];
+        Label* label = &parser.labels->labels[fixup->label];
+        if(label->location == LABEL_UNDEFINED) {
+            printf("Unknown label %s on line %d\n", label->name, fixup->line);
+            parser.failed = true;
+            break;
+        }
+        parser.chunk->data[fixup->offset] = label->location & 0xFF;
+        parser.chunk->data[fixup->offset + 1] = label->location >> 8;
+    }
+    if(parser.failed) {
+        chunkDestroy(parser.chunk);
+        return NULL;
+    }
+    return parser.chunk;
+}
@@ -9,27 +9,45 @@
 #include <ctype.h>
 #include "ops.h"
 #include "chunk.h"
+#include "arena.h"
+
+#define LABEL_UNDEFINED -1
 
 typedef struct {
-    const char* name;
-    short location;
+    const char* name; //Interned, lowercase and terminated
+    int length;
+    unsigned int hash;
+    int location; //Byte address, LABEL_UNDEFINED while it has only been used
+    int line; //Where it was defined, or first used until then
 } Label;
 
+//Labels of one source, kept in its arena. Each name is stored once, slots is an open addressing
+//hash table over it so looking a name up doesn't depend on how many labels there are.
 typedef struct {
-    Label* labels;
+    Label* labels; //In the order they were first seen
     int count;
     int capacity;
+    int* slots; //Index + 1 into labels, 0 for empty
+    int slotCount; //Power of two
+    Arena* arena;
 } LabelTable;
 
-LabelTable* labelTableCreate();
-void labelTableAdd(LabelTable* table, Label label);
-Label* labelTableGet(LabelTable* table, const char* name);
-bool labelTableContains(LabelTable* table, const char* name);
-void labelTableDestroy(LabelTable* table);
+//A use of a label before its definition, patched once the whole source is read
+typedef struct {
+    int label; //Index into labels
+    int offset; //Of the address in the chunk
+    int line;
+} Fixup;
+
+LabelTable* labelTableCreate(Arena* arena);
+//Index of the label, -1 if the name was never seen
+int labelTableFind(LabelTable* table, const char* name, int length);
+//Index of the label, adding an undefined one if the name is new
+int labelTableIntern(LabelTable* table, const char* name, int length, int line);
 
 Chunk* parseFile(const char* filename);
+Chunk* parseFileInArena(const char* filename, Arena* arena);
 Chunk* parseText(char* string);
-int parseOpcode(Chunk* chunk, LabelTable* labels, char* text);
-char** splitString(char* string, char* delimiter, int* count);
+Chunk* parseSource(const char* source, size_t length, Arena* arena);
 
 #endif //FAKEOS_PARSER_H
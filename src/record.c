@@ -0,0 +1,302 @@
+#include <string.h>
+#include <time.h>
+#include "heap.h"
+#include "record.h"
+
+//File layout: "FOSR", version, code length, code hash and memory size, then one entry per recorded
+//syscall. Entry: cycles since the previous entry, syscall, result, host time since the previous entry,
+//changed state words as (index, value) and touched pages as (page, memory, memoryMap, memorySizes).
+//memorySizes only covers the heap, pages past it leave them out.
+#define RECORD_MAGIC "FOSR"
+#define RECORD_VERSION 3
+
+//State words a syscall can change, the registers come first and the input registers last
+#define STATE_BP REGISTER_COUNT
+#define STATE_SP (REGISTER_COUNT + 1)
+#define STATE_FLAGS (REGISTER_COUNT + 2)
+#define STATE_BANK (REGISTER_COUNT + 3)
+#define STATE_INPUT (REGISTER_COUNT + 4)
+#define STATE_COUNT (STATE_INPUT + INPUT_REGISTER_COUNT)
+
+static int pageLength(VM* vm, int page) {
+    int start = page << MEMORY_PAGE_SHIFT;
+    return start + (1 << MEMORY_PAGE_SHIFT) > vm->memorySize ? vm->memorySize - start : 1 << MEMORY_PAGE_SHIFT;
+}
+
+static int pageSizes(VM* vm, int page) {
+    int start = page << MEMORY_PAGE_SHIFT;
+    if(start >= vm->heapSize) {
+        return 0;
+    }
+    return start + pageLength(vm, page) > vm->heapSize ? vm->heapSize - start : pageLength(vm, page);
+}
+
+static long long hostMicroseconds() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return (long long)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+//FNV-1a, only used to catch replaying against the wrong program
+static unsigned int programHash(VM* vm) {
+    unsigned int hash = 2166136261u;
+    for (unsigned int i = 0; i < vm->codeLength; i++) {
+        hash = (hash ^ vm->code[i]) * 16777619u;
+    }
+    return hash;
+}
+
+//region Encoding
+
+static void writeVarint(FILE* file, unsigned long long value) {
+    while(value >= 0x80) {
+        fputc((int)(value & 0x7F) | 0x80, file);
+        value >>= 7;
+    }
+    fputc((int)value, file);
+}
+
+static bool readVarint(FILE* file, unsigned long long* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if(byte == EOF) {
+            return false;
+        }
+        *value |= (unsigned long long)(byte & 0x7F) << shift;
+        if(!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Zigzag keeps small negative numbers short
+static unsigned long long zigzag(long long value) {
+    return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
+}
+
+static long long unzigzag(unsigned long long value) {
+    return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+//endregion
+
+static void readState(VM* vm, unsigned short* state) {
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        state[i] = vm->registers[i];
+    }
+    state[STATE_BP] = vm->bp;
+    state[STATE_SP] = vm->sp;
+    state[STATE_FLAGS] = vm->cmpFlags;
+    state[STATE_BANK] = vm->bank;
+    for (int i = 0; i < INPUT_REGISTER_COUNT; i++) {
+        state[STATE_INPUT + i] = vm->input[i];
+    }
+}
+
+static void writeState(VM* vm, int index, unsigned short value) {
+    if(index < REGISTER_COUNT) {
+        vm->registers[index] = value;
+    } else if(index == STATE_BP) {
+        vm->bp = value;
+    } else if(index == STATE_SP) {
+        vm->sp = value;
+    } else if(index == STATE_FLAGS) {
+        vm->cmpFlags = (unsigned char)value;
+    } else if(index == STATE_BANK) {
+        vmSetBank(vm, value);
+    } else {
+        vm->input[index - STATE_INPUT] = value;
+    }
+}
+
+Recorder* recorderOpen(VM* vm, const char* path, RecordMode mode) {
+    FILE* file = fopen(path, mode == RECORD_RECORDING ? "wb" : "rb");
+    if(file == NULL) {
+        printf("Error opening file\n");
+        return NULL;
+    }
+
+    unsigned long long length = vm->codeLength;
+    unsigned long long hash = programHash(vm);
+    if(mode == RECORD_RECORDING) {
+        fwrite(RECORD_MAGIC, 1, 4, file);
+        fputc(RECORD_VERSION, file);
+        writeVarint(file, length);
+        writeVarint(file, hash);
+        writeVarint(file, vm->memorySize);
+    } else {
+        char magic[4];
+        unsigned long long recordedLength;
+        unsigned long long recordedHash;
+        unsigned long long recordedMemory;
+        bool valid = fread(magic, 1, 4, file) == 4 && memcmp(magic, RECORD_MAGIC, 4) == 0 &&
+                     fgetc(file) == RECORD_VERSION &&
+                     readVarint(file, &recordedLength) && readVarint(file, &recordedHash) &&
+                     readVarint(file, &recordedMemory);
+        if(!valid || recordedLength != length || recordedHash != hash || recordedMemory != vm->memorySize) {
+            printf("Recording doesn't match the program\n");
+            fclose(file);
+            return NULL;
+        }
+    }
+
+    Recorder* recorder = malloc(sizeof(Recorder));
+    recorder->mode = mode;
+    recorder->file = file;
+    recorder->error = NULL;
+    recorder->cycles = vm->cycles;
+    recorder->startTime = hostMicroseconds();
+    recorder->hostTime = 0;
+    vm->recorder = recorder;
+    return recorder;
+}
+
+void recorderClose(VM* vm) {
+    Recorder* recorder = vm->recorder;
+    if(recorder == NULL) {
+        return;
+    }
+    fclose(recorder->file);
+    free(recorder);
+    vm->recorder = NULL;
+}
+
+static int recordSysCall(VM* vm, Recorder* recorder, int sysCall) {
+    FILE* file = recorder->file;
+    unsigned short before[STATE_COUNT];
+    unsigned short after[STATE_COUNT];
+    readState(vm, before);
+
+    //Pages the syscall writes get stamped with a generation of their own
+    vm->generation++;
+    int result = vm->sysCalls[sysCall](vm);
+    readState(vm, after);
+
+    long long time = hostMicroseconds() - recorder->startTime;
+    writeVarint(file, vm->cycles - recorder->cycles);
+    fputc(sysCall, file);
+    writeVarint(file, zigzag(result));
+    writeVarint(file, zigzag(time - recorder->hostTime));
+
+    int changed = 0;
+    for (int i = 0; i < STATE_COUNT; i++) {
+        changed += before[i] != after[i];
+    }
+    fputc(changed, file);
+    for (int i = 0; i < STATE_COUNT; i++) {
+        if(before[i] != after[i]) {
+            fputc(i, file);
+            fputc(after[i] & 0xFF, file);
+            fputc(after[i] >> 8, file);
+        }
+    }
+
+    int touched = 0;
+    for (int page = 0; page < vm->memoryPages; page++) {
+        touched += vm->pageVersions[page] == vm->generation;
+    }
+    writeVarint(file, touched);
+    for (int page = 0; page < vm->memoryPages; page++) {
+        if(vm->pageVersions[page] != vm->generation) {
+            continue;
+        }
+        int start = page << MEMORY_PAGE_SHIFT;
+        writeVarint(file, page);
+        fwrite(vm->memory + start, 1, pageLength(vm, page), file);
+        for (int i = start; i < start + pageLength(vm, page); i++) {
+            fputc(vm->memoryMap[i], file);
+        }
+        for (int i = start; i < start + pageSizes(vm, page); i++) {
+            fputc(vm->memorySizes[i] & 0xFF, file);
+            fputc(vm->memorySizes[i] >> 8, file);
+        }
+    }
+
+    recorder->cycles = vm->cycles;
+    recorder->hostTime = time;
+    return result;
+}
+
+static int replayFail(Recorder* recorder, const char* error) {
+    recorder->error = error;
+    return 1;
+}
+
+static int replaySysCall(VM* vm, Recorder* recorder, int sysCall) {
+    FILE* file = recorder->file;
+    if(recorder->error != NULL) {
+        return 1;
+    }
+
+    unsigned long long cycles;
+    unsigned long long result;
+    unsigned long long time;
+    if(!readVarint(file, &cycles)) {
+        return replayFail(recorder, "Replay ended");
+    }
+    int recordedSysCall = fgetc(file);
+    if(!readVarint(file, &result) || !readVarint(file, &time)) {
+        return replayFail(recorder, "Corrupt recording");
+    }
+    if(recorder->cycles + cycles != vm->cycles || recordedSysCall != sysCall) {
+        return replayFail(recorder, "Replay out of sync");
+    }
+
+    vm->generation++;
+    int changed = fgetc(file);
+    for (int i = 0; i < changed; i++) {
+        int index = fgetc(file);
+        int lo = fgetc(file);
+        int hi = fgetc(file);
+        if(index < 0 || index >= STATE_COUNT || hi == EOF) {
+            return replayFail(recorder, "Corrupt recording");
+        }
+        writeState(vm, index, (unsigned short)(lo | hi << 8));
+    }
+
+    unsigned long long touched;
+    if(changed == EOF || !readVarint(file, &touched)) {
+        return replayFail(recorder, "Corrupt recording");
+    }
+    for (unsigned long long i = 0; i < touched; i++) {
+        unsigned long long page;
+        if(!readVarint(file, &page) || page >= vm->memoryPages) {
+            return replayFail(recorder, "Corrupt recording");
+        }
+        int start = (int)page << MEMORY_PAGE_SHIFT;
+        int length = pageLength(vm, (int)page);
+        if(fread(vm->memory + start, 1, length, file) != length) {
+            return replayFail(recorder, "Corrupt recording");
+        }
+        for (int j = start; j < start + length; j++) {
+            vm->memoryMap[j] = fgetc(file) == 1;
+        }
+        for (int j = start; j < start + pageSizes(vm, (int)page); j++) {
+            int lo = fgetc(file);
+            int hi = fgetc(file);
+            vm->memorySizes[j] = (unsigned short)(lo | hi << 8);
+        }
+        vmTouchMemory(vm, start, length);
+    }
+    if(feof(file)) {
+        return replayFail(recorder, "Corrupt recording");
+    }
+    if(touched > 0) {
+        heapRebuild(vm);
+    }
+
+    recorder->cycles = vm->cycles;
+    recorder->hostTime += unzigzag(time);
+    return (int)unzigzag(result);
+}
+
+//Runs a syscall registered with vmSysCallRecorded
+int recorderSysCall(VM* vm, int sysCall) {
+    Recorder* recorder = vm->recorder;
+    if(recorder->mode == RECORD_RECORDING) {
+        return recordSysCall(vm, recorder, sysCall);
+    }
+    return replaySysCall(vm, recorder, sysCall);
+}
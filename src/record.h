@@ -0,0 +1,30 @@
+#ifndef FAKEOS_RECORD_H
+#define FAKEOS_RECORD_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "asm.h"
+
+//Syscalls registered with vmSysCallRecorded depend on the outside world. While recording their
+//effects are logged, on replay they aren't called and the logged effects are applied instead.
+//Everything else is deterministic, so the rest of the run repeats by itself.
+typedef enum {
+    RECORD_RECORDING,
+    RECORD_REPLAYING,
+} RecordMode;
+
+typedef struct Recorder {
+    RecordMode mode;
+    FILE* file;
+    const char* error; //Set when the replay stopped matching the recording
+
+    unsigned long long cycles; //vm->cycles at the last recorded syscall
+    long long startTime; //Microseconds
+    long long hostTime; //Microseconds since the start of the recording at the last recorded syscall
+} Recorder;
+
+Recorder* recorderOpen(VM* vm, const char* path, RecordMode mode);
+void recorderClose(VM* vm);
+int recorderSysCall(VM* vm, int sysCall);
+
+#endif //FAKEOS_RECORD_H
@@ -1,15 +1,404 @@
+#include <assert.h>
 #include "rendering.h"
 
 Screen* screenCreate(int width, int height) {
     Screen *screen = malloc(sizeof(Screen));
-    screen->buffer = malloc(width * height * sizeof(unsigned char));
+    screen->buffer = calloc(width * height, sizeof(unsigned char));
     screen->width = width;
     screen->height = height;
+    screen->pageVersions = calloc(screenPageCount(screen), sizeof(unsigned int));
+    screen->dirty = malloc(height * sizeof(Span));
+    screenMarkAllDirty(screen);
     return screen;
 }
 
+void screenDestroy(Screen* screen) {
+    free(screen->buffer);
+    free(screen->pageVersions);
+    free(screen->dirty);
+    free(screen);
+}
+
+int screenPageCount(Screen* screen) {
+    return (screen->width * screen->height + (1 << SCREEN_PAGE_SHIFT) - 1) >> SCREEN_PAGE_SHIFT;
+}
+
+static void spanAdd(Span* span, int left, int right) {
+    if(span->left >= span->right) {
+        span->left = (short)left;
+        span->right = (short)right;
+        return;
+    }
+    if(left < span->left) {
+        span->left = (short)left;
+    }
+    if(right > span->right) {
+        span->right = (short)right;
+    }
+}
+
+void screenMarkDirty(Screen* screen, int x, int y, int width, int height) {
+    int left = x < 0 ? 0 : x;
+    int right = x + width > screen->width ? screen->width : x + width;
+    int top = y < 0 ? 0 : y;
+    int bottom = y + height > screen->height ? screen->height : y + height;
+    if(left >= right) {
+        return;
+    }
+    for (int row = top; row < bottom; row++) {
+        spanAdd(&screen->dirty[row], left, right);
+    }
+}
+
+void screenMarkAllDirty(Screen* screen) {
+    for (int row = 0; row < screen->height; row++) {
+        screen->dirty[row] = (Span){0, (short)screen->width};
+    }
+}
+
+static void spansAdd(Span* spans, const Span* other, int height) {
+    for (int row = 0; row < height; row++) {
+        if(other[row].left < other[row].right) {
+            spanAdd(&spans[row], other[row].left, other[row].right);
+        }
+    }
+}
+
+void screenMarkSpansDirty(Screen* screen, const Span* spans) {
+    spansAdd(screen->dirty, spans, screen->height);
+}
+
+void screenMarkBytesDirty(Screen* screen, int start, int length) {
+    int first = start / screen->width;
+    int last = (start + length - 1) / screen->width;
+    if(first == last) {
+        screenMarkDirty(screen, start % screen->width, first, length, 1);
+    } else {
+        screenMarkDirty(screen, 0, first, screen->width, last - first + 1);
+    }
+}
+
+void screenTouch(Screen* screen, Rect rect, unsigned int generation) {
+    for (int row = rect.y; row < rect.y + rect.height; row++) {
+        int start = row * screen->width + rect.x;
+        int end = start + rect.width - 1;
+        for (int page = start >> SCREEN_PAGE_SHIFT; page <= end >> SCREEN_PAGE_SHIFT; page++) {
+            screen->pageVersions[page] = generation;
+        }
+    }
+    screenMarkDirty(screen, rect.x, rect.y, rect.width, rect.height);
+}
+
+bool rectClip(int screenWidth, int screenHeight, int x, int y, int width, int height, Rect* clipped) {
+    int left = x < 0 ? 0 : x;
+    int top = y < 0 ? 0 : y;
+    int right = x + width > screenWidth ? screenWidth : x + width;
+    int bottom = y + height > screenHeight ? screenHeight : y + height;
+    if(left >= right || top >= bottom) {
+        return false;
+    }
+    *clipped = (Rect){left, top, right - left, bottom - top};
+    return true;
+}
+
+bool screenBlit(Screen* screen, const unsigned char* pixels, int width, int height, int x, int y,
+                int key, int flags, Rect* drawn) {
+    Rect clipped;
+    if(!rectClip(screen->width, screen->height, x, y, width, height, &clipped)) {
+        return false;
+    }
+    int left = clipped.x;
+    int top = clipped.y;
+    int right = clipped.x + clipped.width;
+    int bottom = clipped.y + clipped.height;
+
+    int count = right - left;
+    for (int row = top; row < bottom; row++) {
+        int sourceRow = flags & BLIT_FLIP_Y ? height - 1 - (row - y) : row - y;
+        unsigned char* to = screen->buffer + row * screen->width + left;
+        if(flags & BLIT_FLIP_X) {
+            //Screen column left shows image column width - 1 - (left - x), going backwards from there
+            const unsigned char* from = pixels + sourceRow * width + width - 1 - (left - x);
+            if(key < 0) {
+                for (int i = 0; i < count; i++) {
+                    to[i] = from[-i];
+                }
+            } else {
+                for (int i = 0; i < count; i++) {
+                    to[i] = from[-i] == key ? to[i] : from[-i];
+                }
+            }
+            continue;
+        }
+
+        const unsigned char* from = pixels + sourceRow * width + (left - x);
+        if(key < 0) {
+            memcpy(to, from, count);
+        } else {
+            //Written as a select so the compiler can turn it into a masked blend
+            for (int i = 0; i < count; i++) {
+                to[i] = from[i] == key ? to[i] : from[i];
+            }
+        }
+    }
+
+    *drawn = clipped;
+    return true;
+}
+
+bool screenFillRect(Screen* screen, int x, int y, int width, int height, unsigned char color, Rect* drawn) {
+    Rect clipped;
+    if(!rectClip(screen->width, screen->height, x, y, width, height, &clipped)) {
+        return false;
+    }
+    int left = clipped.x;
+    int top = clipped.y;
+    int right = clipped.x + clipped.width;
+    int bottom = clipped.y + clipped.height;
+
+    if(left == 0 && right == screen->width) {
+        memset(screen->buffer + top * screen->width, color, (bottom - top) * screen->width);
+    } else {
+        for (int row = top; row < bottom; row++) {
+            memset(screen->buffer + row * screen->width + left, color, right - left);
+        }
+    }
+    *drawn = clipped;
+    return true;
+}
+
+//Steps k with start + step * k inside [0, size), step is 1 or -1
+static void stepsInside(int start, int step, int size, long long* low, long long* high) {
+    *low = step > 0 ? -start : start - (size - 1);
+    *high = step > 0 ? size - 1 - start : start;
+}
+
+//Bresenham takes one step along the longer axis per point and puts point i at the offset
+//(2 * i * minor + major) / (2 * major) on the other one. Both only ever grow, so the points
+//on screen are the run of steps [first, last], far off screen ends cost nothing.
+typedef struct {
+    bool steep;
+    int majorStart, minorStart;
+    int majorStep, minorStep;
+    long long major, minor;
+    long long first, last;
+} LineSteps;
+
+//Lines that aren't straight, false when no point is on screen
+static bool lineSteps(int screenWidth, int screenHeight, int x0, int y0, int x1, int y1, LineSteps* line) {
+    bool steep = abs(y1 - y0) > abs(x1 - x0);
+    line->steep = steep;
+    line->majorStart = steep ? y0 : x0;
+    line->minorStart = steep ? x0 : y0;
+    line->majorStep = (steep ? y0 < y1 : x0 < x1) ? 1 : -1;
+    line->minorStep = (steep ? x0 < x1 : y0 < y1) ? 1 : -1;
+    line->major = steep ? abs(y1 - y0) : abs(x1 - x0);
+    line->minor = steep ? abs(x1 - x0) : abs(y1 - y0);
+    long long major = line->major;
+    long long minor = line->minor;
+
+    long long first, last, low, high;
+    stepsInside(line->majorStart, line->majorStep, steep ? screenHeight : screenWidth, &first, &last);
+    first = first > 0 ? first : 0;
+    last = last < major ? last : major;
+    stepsInside(line->minorStart, line->minorStep, steep ? screenWidth : screenHeight, &low, &high);
+    if(low > minor || high < 0) {
+        return false;
+    }
+    //First step reaching offset low and last one before offset high + 1
+    if(low > 0) {
+        long long from = (2 * major * low - major + 2 * minor - 1) / (2 * minor);
+        first = from > first ? from : first;
+    }
+    if(high < minor) {
+        long long to = (2 * major * (high + 1) - major + 2 * minor - 1) / (2 * minor) - 1;
+        last = to < last ? to : last;
+    }
+    line->first = first;
+    line->last = last;
+    return first <= last;
+}
+
+static void linePoint(const LineSteps* line, long long step, int* x, int* y) {
+    int along = line->majorStart + line->majorStep * (int)step;
+    int across = line->minorStart + line->minorStep * (int)((2 * step * line->minor + line->major) / (2 * line->major));
+    *x = line->steep ? across : along;
+    *y = line->steep ? along : across;
+}
+
+//The points only move one way, so the ends span the rest
+static Rect lineBounds(const LineSteps* line) {
+    int x0, y0, x1, y1;
+    linePoint(line, line->first, &x0, &y0);
+    linePoint(line, line->last, &x1, &y1);
+    return (Rect){x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1, abs(x1 - x0) + 1, abs(y1 - y0) + 1};
+}
+
+bool lineClip(int screenWidth, int screenHeight, int x0, int y0, int x1, int y1, Rect* clipped) {
+    if(y0 == y1 || x0 == x1) {
+        return rectClip(screenWidth, screenHeight, x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1,
+                        abs(x1 - x0) + 1, abs(y1 - y0) + 1, clipped);
+    }
+    LineSteps line;
+    if(!lineSteps(screenWidth, screenHeight, x0, y0, x1, y1, &line)) {
+        return false;
+    }
+    *clipped = lineBounds(&line);
+    return true;
+}
+
+bool screenDrawLine(Screen* screen, int x0, int y0, int x1, int y1, unsigned char color, Rect* drawn) {
+    //Straight lines are spans
+    if(y0 == y1 || x0 == x1) {
+        int left = x0 < x1 ? x0 : x1;
+        int top = y0 < y1 ? y0 : y1;
+        return screenFillRect(screen, left, top, abs(x1 - x0) + 1, abs(y1 - y0) + 1, color, drawn);
+    }
+
+    LineSteps line;
+    if(!lineSteps(screen->width, screen->height, x0, y0, x1, y1, &line)) {
+        return false;
+    }
+    long long twiceMajor = 2 * line.major;
+    long long remainder = (2 * line.first * line.minor + line.major) % twiceMajor;
+    int offset = (int)((2 * line.first * line.minor + line.major) / twiceMajor);
+    for (long long i = line.first; i <= line.last; i++) {
+        int along = line.majorStart + line.majorStep * (int)i;
+        int across = line.minorStart + line.minorStep * offset;
+        int x = line.steep ? across : along;
+        int y = line.steep ? along : across;
+        screen->buffer[y * screen->width + x] = color;
+        remainder += 2 * line.minor;
+        if(remainder >= twiceMajor) {
+            remainder -= twiceMajor;
+            offset++;
+        }
+    }
+    *drawn = lineBounds(&line);
+    return true;
+}
+
+//All of the rows, nothing copied yet is up to date
+static Span* spansCreateWhole(int width, int height) {
+    Span* spans = malloc(height * sizeof(Span));
+    for (int row = 0; row < height; row++) {
+        spans[row] = (Span){0, (short)width};
+    }
+    return spans;
+}
+
+TripleBuffer* tripleBufferCreate(int width, int height) {
+    TripleBuffer* buffer = malloc(sizeof(TripleBuffer));
+    for (int i = 0; i < 3; i++) {
+        buffer->slots[i] = screenCreate(width, height);
+        buffer->stale[i] = spansCreateWhole(width, height);
+    }
+    buffer->unseen = spansCreateWhole(width, height);
+    buffer->writing = 0;
+    atomic_init(&buffer->ready, 1);
+    buffer->reading = 2;
+    return buffer;
+}
+
+void tripleBufferDestroy(TripleBuffer* buffer) {
+    for (int i = 0; i < 3; i++) {
+        screenDestroy(buffer->slots[i]);
+        free(buffer->stale[i]);
+    }
+    free(buffer->unseen);
+    free(buffer);
+}
+
+void tripleBufferPublish(TripleBuffer* buffer, Screen* screen, const FrameTiming* timing) {
+    Screen* slot = buffer->slots[buffer->writing];
+    assert(slot->width == screen->width && slot->height == screen->height);
+    buffer->timings[buffer->writing] = *timing;
+    int height = screen->height;
+
+    //Every slot falls behind by the rows that changed, the one being written catches up on all it missed
+    for (int i = 0; i < 3; i++) {
+        spansAdd(buffer->stale[i], screen->dirty, height);
+    }
+    Span* stale = buffer->stale[buffer->writing];
+    for (int row = 0; row < height; row++) {
+        if(stale[row].left < stale[row].right) {
+            int offset = row * screen->width + stale[row].left;
+            memcpy(slot->buffer + offset, screen->buffer + offset, stale[row].right - stale[row].left);
+            stale[row] = (Span){0, 0};
+        }
+    }
+
+    //The presenter needs everything since the last frame it took. That was the previous one unless
+    //it is still fresh, and if it gets taken right after this check the spans are only too big.
+    if(!(atomic_load_explicit(&buffer->ready, memory_order_acquire) & TRIPLE_BUFFER_FRESH)) {
+        memset(buffer->unseen, 0, height * sizeof(Span));
+    }
+    spansAdd(buffer->unseen, screen->dirty, height);
+    memcpy(slot->dirty, buffer->unseen, height * sizeof(Span));
+    memset(screen->dirty, 0, height * sizeof(Span));
+
+    unsigned int last = atomic_exchange_explicit(&buffer->ready, buffer->writing | TRIPLE_BUFFER_FRESH, memory_order_acq_rel);
+    buffer->writing = last & ~TRIPLE_BUFFER_FRESH;
+}
+
+Screen* tripleBufferTake(TripleBuffer* buffer, FrameTiming* timing) {
+    if(!(atomic_load_explicit(&buffer->ready, memory_order_acquire) & TRIPLE_BUFFER_FRESH)) {
+        return NULL;
+    }
+    unsigned int next = atomic_exchange_explicit(&buffer->ready, buffer->reading, memory_order_acq_rel);
+    buffer->reading = next & ~TRIPLE_BUFFER_FRESH;
+    *timing = buffer->timings[buffer->reading];
+    return buffer->slots[buffer->reading];
+}
+
+static int wrap(int value, int size) {
+    value %= size;
+    return value < 0 ? value + size : value;
+}
+
+void screenDrawTiles(Screen* screen, const unsigned char* tileset, const unsigned char* map, int width, int height,
+                     int scrollX, int scrollY) {
+    int mapWidth = width << TILE_SHIFT;
+    int mapHeight = height << TILE_SHIFT;
+    int startX = wrap(scrollX, mapWidth);
+    int mapY = wrap(scrollY, mapHeight);
+
+    for (int row = 0; row < screen->height; row++) {
+        const unsigned char* tiles = map + (mapY >> TILE_SHIFT) * width;
+        const unsigned char* tileRow = tileset + (mapY & (TILE_SIZE - 1)) * TILE_SIZE;
+        unsigned char* to = screen->buffer + row * screen->width;
+
+        //Whole tile rows in the middle are a single 8 byte move, only the edges are partial
+        int mapX = startX;
+        for (int x = 0; x < screen->width;) {
+            const unsigned char* from = tileRow + tiles[mapX >> TILE_SHIFT] * TILE_BYTES;
+            int fine = mapX & (TILE_SIZE - 1);
+            int count = screen->width - x;
+            if(fine == 0 && count >= TILE_SIZE) {
+                memcpy(to + x, from, TILE_SIZE);
+                count = TILE_SIZE;
+            } else {
+                count = TILE_SIZE - fine < count ? TILE_SIZE - fine : count;
+                memcpy(to + x, from + fine, count);
+            }
+            x += count;
+            mapX += count;
+            if(mapX == mapWidth) {
+                mapX = 0;
+            }
+        }
+
+        mapY++;
+        if(mapY == mapHeight) {
+            mapY = 0;
+        }
+    }
+}
+
 Palette* paletteCreate() {
     Palette *palette = malloc(sizeof(Palette));
+    palette->lutValid = false;
+    palette->version = 0;
     palette->colors = malloc(256 * sizeof(Color));
 
     //Generate the vga palette
@@ -47,5 +436,135 @@ Palette* paletteCreate() {
         }
     }
 
+    paletteUpdateLut(palette);
     return palette;
-}
\ No newline at end of file
+}
+
+void paletteSetColor(Palette* palette, int index, Color color) {
+    palette->colors[index] = color;
+    palette->lutValid = false;
+}
+
+void paletteUpdateLut(Palette* palette) {
+    if(palette->lutValid) {
+        return;
+    }
+    //RGBA32 is defined by byte order, so the bytes are written one by one to stay endian independent
+    for (int i = 0; i < 256; i++) {
+        unsigned char* pixel = (unsigned char*)&palette->lut[i];
+        pixel[0] = palette->colors[i].r;
+        pixel[1] = palette->colors[i].g;
+        pixel[2] = palette->colors[i].b;
+        pixel[3] = 0xFF;
+    }
+    palette->lutValid = true;
+    palette->version++;
+}
+
+//The lookup is a gather, unrolling lets the loads of several pixels overlap
+static void convertSpan(const unsigned int* lut, const unsigned char* restrict from, unsigned int* restrict to, int count) {
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        to[x] = lut[from[x]];
+        to[x + 1] = lut[from[x + 1]];
+        to[x + 2] = lut[from[x + 2]];
+        to[x + 3] = lut[from[x + 3]];
+        to[x + 4] = lut[from[x + 4]];
+        to[x + 5] = lut[from[x + 5]];
+        to[x + 6] = lut[from[x + 6]];
+        to[x + 7] = lut[from[x + 7]];
+    }
+    for (; x < count; x++) {
+        to[x] = lut[from[x]];
+    }
+}
+
+void screenConvert(Screen* screen, Palette* palette, void* pixels, int pitch) {
+    for (int y = 0; y < screen->height; y++) {
+        convertSpan(palette->lut, screen->buffer + y * screen->width,
+                    (unsigned int*)((unsigned char*)pixels + y * pitch), screen->width);
+    }
+}
+
+Display* displayCreate(int width, int height) {
+    Display* display = malloc(sizeof(Display));
+    display->width = width;
+    display->height = height;
+    display->shown = malloc(width * height);
+    display->pixels = malloc(width * height * sizeof(unsigned int));
+    display->changed = calloc(height, sizeof(Span));
+    display->screen = NULL;
+    display->paletteVersion = 0;
+    display->valid = false;
+    return display;
+}
+
+void displayDestroy(Display* display) {
+    free(display->shown);
+    free(display->pixels);
+    free(display->changed);
+    free(display);
+}
+
+bool displayUpdate(Display* display, Screen* screen, Palette* palette, Rect* changed) {
+    if(screen->width != display->width || screen->height != display->height) {
+        return false;
+    }
+    paletteUpdateLut(palette);
+    bool whole = !display->valid || display->paletteVersion != palette->version;
+    bool same = display->screen == screen;
+
+    int top = screen->height;
+    int bottom = 0;
+    int left = screen->width;
+    int right = 0;
+    for (int y = 0; y < screen->height; y++) {
+        Span span = whole ? (Span){0, (short)screen->width} : screen->dirty[y];
+        Span* last = &display->changed[y];
+        Span previous = *last;
+        if(!whole && previous.left < previous.right) {
+            spanAdd(&span, previous.left, previous.right);
+        }
+        screen->dirty[y] = (Span){0, 0};
+        if(!same) {
+            *last = (Span){0, 0};
+        }
+
+        int offset = y * screen->width + span.left;
+        int count = span.right - span.left;
+        if(count <= 0 || (!whole && memcmp(display->shown + offset, screen->buffer + offset, count) == 0)) {
+            continue;
+        }
+        //Trim the unchanged ends, frames handed over whole are all dirty
+        if(!whole) {
+            while(display->shown[offset] == screen->buffer[offset]) {
+                offset++;
+                span.left++;
+            }
+            while(display->shown[offset + span.right - span.left - 1] == screen->buffer[offset + span.right - span.left - 1]) {
+                span.right--;
+            }
+            count = span.right - span.left;
+        }
+        memcpy(display->shown + offset, screen->buffer + offset, count);
+        convertSpan(palette->lut, screen->buffer + offset, display->pixels + offset, count);
+        *last = span;
+        if(same && previous.left < previous.right) {
+            spanAdd(last, previous.left, previous.right);
+        }
+
+        top = y < top ? y : top;
+        bottom = y + 1;
+        left = span.left < left ? span.left : left;
+        right = span.right > right ? span.right : right;
+    }
+    display->screen = screen;
+    display->valid = true;
+    display->paletteVersion = palette->version;
+
+    if(top >= bottom) {
+        return false;
+    }
+    *changed = (Rect){left, top, right - left, bottom - top};
+    return true;
+}
@@ -3,13 +3,91 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "telemetry.h"
+
+#define SCREEN_PAGE_SHIFT 8 //Snapshots track changes in 256 byte pages
+
+typedef struct {
+    int x, y, width, height;
+} Rect;
+
+//Columns [left, right) of one row, clean when left >= right
+typedef struct {
+    short left, right;
+} Span;
 
 typedef struct {
     unsigned char *buffer;
     int width, height;
+    unsigned int* pageVersions; //Snapshot generation each page last changed in
+    Span* dirty; //Each row's changes since the screen was last presented
 } Screen;
 
 Screen* screenCreate(int width, int height);
+void screenDestroy(Screen* screen);
+int screenPageCount(Screen* screen);
+void screenMarkDirty(Screen* screen, int x, int y, int width, int height);
+void screenMarkAllDirty(Screen* screen);
+//Adds one span per row, like the screen's own dirty spans
+void screenMarkSpansDirty(Screen* screen, const Span* spans);
+//Marks the rows holding buffer[start, start + length)
+void screenMarkBytesDirty(Screen* screen, int start, int length);
+//Stamps the snapshot pages under the rectangle with generation and marks it dirty
+void screenTouch(Screen* screen, Rect rect, unsigned int generation);
+
+typedef enum {
+    BLIT_FLIP_X = 1,
+    BLIT_FLIP_Y = 2,
+} BlitFlags;
+
+//Draws a width x height image with its top left corner at x, y, clipped to the screen.
+//Pixels equal to key are skipped, a key of -1 draws every pixel.
+//Returns false when nothing is on screen, otherwise drawn holds the clipped rectangle.
+bool screenBlit(Screen* screen, const unsigned char* pixels, int width, int height, int x, int y,
+                int key, int flags, Rect* drawn);
+//Like screenBlit these clip to the screen and return false when nothing is on screen
+bool screenFillRect(Screen* screen, int x, int y, int width, int height, unsigned char color, Rect* drawn);
+//Draws both end points, drawn gets the clipped bounds of the line
+bool screenDrawLine(Screen* screen, int x0, int y0, int x1, int y1, unsigned char color, Rect* drawn);
+//What the calls above clip to on a screen of that size, without drawing anything. The VM charges
+//drawing by these, so it costs the same with and without a screen to draw on.
+bool rectClip(int screenWidth, int screenHeight, int x, int y, int width, int height, Rect* clipped);
+bool lineClip(int screenWidth, int screenHeight, int x0, int y0, int x1, int y1, Rect* clipped);
+
+//Hands finished frames from the VM thread to the thread presenting them. Each side owns one slot,
+//the third one holds the newest finished frame. Publishing and taking swap a side's slot with it,
+//so the VM never waits for a present and the presenter always gets the newest frame.
+#define TRIPLE_BUFFER_FRESH 4 //Set in ready until the presenter takes the frame
+
+typedef struct {
+    Screen* slots[3];
+    FrameTiming timings[3]; //Travels with the frame in the same slot
+    Span* stale[3]; //Rows each slot is behind the newest frame by, only used by the VM thread
+    Span* unseen; //Changes since the last frame the presenter took, only used by the VM thread
+    atomic_uint ready; //Slot with the newest frame, plus TRIPLE_BUFFER_FRESH
+    unsigned int writing; //Only used by the VM thread
+    unsigned int reading; //Only used by the presenting thread
+} TripleBuffer;
+
+TripleBuffer* tripleBufferCreate(int width, int height);
+void tripleBufferDestroy(TripleBuffer* buffer);
+//Copies the rows of the screen that changed, with its timing, into the VM's slot and makes it the newest
+//frame. The screen's dirty spans have to cover what changed since the previous frame, they are used up
+//here. It has to have the size the buffer was created with.
+void tripleBufferPublish(TripleBuffer* buffer, Screen* screen, const FrameTiming* timing);
+//Returns the newest frame and fills in its timing, or NULL when there is nothing new since the last call
+Screen* tripleBufferTake(TripleBuffer* buffer, FrameTiming* timing);
+
+#define TILE_SHIFT 3 //Tiles are 8x8
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_BYTES (TILE_SIZE * TILE_SIZE)
+
+//Covers the whole screen with a map of width x height tile indices, each picking a tile of the tileset.
+//The map repeats, scroll is the map pixel shown in the top left corner.
+void screenDrawTiles(Screen* screen, const unsigned char* tileset, const unsigned char* map, int width, int height,
+                     int scrollX, int scrollY);
 
 typedef struct {
     unsigned char r, g, b;
@@ -17,9 +95,35 @@ typedef struct {
 
 typedef struct {
     Color* colors;
+    unsigned int lut[256]; //colors as RGBA32 pixels, rebuilt by paletteUpdateLut
+    bool lutValid; //Cleared whenever colors change
+    unsigned int version; //Bumped every time the LUT is rebuilt
 } Palette;
 
 Palette* paletteCreate();
+void paletteSetColor(Palette* palette, int index, Color color);
+void paletteUpdateLut(Palette* palette);
+
+//Converts the screen to RGBA32 rows pitch bytes apart, the palette LUT has to be up to date
+void screenConvert(Screen* screen, Palette* palette, void* pixels, int pitch);
+
+//What the window currently shows, as indexed colors and as RGBA32 pixels. With double buffering
+//the screen being presented was last shown two flips ago, so besides its own dirty spans whatever
+//the other buffer put on the display since then has to be redone. Spans where both agree are skipped.
+typedef struct {
+    int width, height;
+    unsigned char* shown;
+    unsigned int* pixels;
+    Screen* screen; //Screen of the last update
+    Span* changed; //Spans updated since a screen other than screen was shown
+    unsigned int paletteVersion;
+    bool valid;
+} Display;
 
+Display* displayCreate(int width, int height);
+void displayDestroy(Display* display);
+//Brings the display up to date with the screen and clears the screen's dirty spans.
+//Returns false when nothing changed, otherwise changed holds the bounds of every converted span.
+bool displayUpdate(Display* display, Screen* screen, Palette* palette, Rect* changed);
 
 #endif //FAKEOS_RENDERING_H
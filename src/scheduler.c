@@ -0,0 +1,152 @@
+#define _DEFAULT_SOURCE //sysconf under strict C11
+#include <sched.h>
+#include <unistd.h>
+#include "scheduler.h"
+
+//region Work queue
+
+static void workQueueInit(WorkQueue* queue) {
+    queue->capacity = 16;
+    queue->vms = malloc(sizeof(VM*) * queue->capacity);
+    queue->head = 0;
+    queue->count = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+}
+
+static void workQueuePush(WorkQueue* queue, VM* vm) {
+    pthread_mutex_lock(&queue->lock);
+    if(queue->count == queue->capacity) {
+        VM** vms = malloc(sizeof(VM*) * queue->capacity * 2);
+        for (int i = 0; i < queue->count; i++) {
+            vms[i] = queue->vms[(queue->head + i) % queue->capacity];
+        }
+        free(queue->vms);
+        queue->vms = vms;
+        queue->head = 0;
+        queue->capacity *= 2;
+    }
+    queue->vms[(queue->head + queue->count) % queue->capacity] = vm;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static VM* workQueueTakeFront(WorkQueue* queue) {
+    VM* vm = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if(queue->count > 0) {
+        vm = queue->vms[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return vm;
+}
+
+static VM* workQueueTakeBack(WorkQueue* queue) {
+    VM* vm = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if(queue->count > 0) {
+        queue->count--;
+        vm = queue->vms[(queue->head + queue->count) % queue->capacity];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return vm;
+}
+
+static void workQueueDestroy(WorkQueue* queue) {
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->vms);
+}
+
+//endregion
+
+Scheduler* schedulerCreate(int workerCount, long long slice) {
+    if(workerCount <= 0) {
+        workerCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if(workerCount <= 0) {
+            workerCount = 1;
+        }
+    }
+
+    Scheduler* scheduler = malloc(sizeof(Scheduler));
+    scheduler->workers = malloc(sizeof(Worker) * workerCount);
+    scheduler->workerCount = workerCount;
+    scheduler->next = 0;
+    scheduler->slice = slice;
+    scheduler->cycleLimit = 0;
+    atomic_init(&scheduler->remaining, 0);
+    scheduler->finished = NULL;
+    for (int i = 0; i < workerCount; i++) {
+        scheduler->workers[i].scheduler = scheduler;
+        scheduler->workers[i].index = i;
+        workQueueInit(&scheduler->workers[i].queue);
+    }
+    return scheduler;
+}
+
+//Spreads the VMs evenly, stealing evens out whatever runs longer
+void schedulerAdd(Scheduler* scheduler, VM* vm) {
+    workQueuePush(&scheduler->workers[scheduler->next].queue, vm);
+    scheduler->next = (scheduler->next + 1) % scheduler->workerCount;
+    atomic_fetch_add(&scheduler->remaining, 1);
+}
+
+static VM* schedulerSteal(Scheduler* scheduler, int thief) {
+    for (int i = 1; i < scheduler->workerCount; i++) {
+        Worker* victim = &scheduler->workers[(thief + i) % scheduler->workerCount];
+        VM* vm = workQueueTakeBack(&victim->queue);
+        if(vm != NULL) {
+            return vm;
+        }
+    }
+    return NULL;
+}
+
+static void* workerRun(void* arg) {
+    Worker* worker = arg;
+    Scheduler* scheduler = worker->scheduler;
+
+    while(atomic_load(&scheduler->remaining) > 0) {
+        VM* vm = workQueueTakeFront(&worker->queue);
+        if(vm == NULL) {
+            vm = schedulerSteal(scheduler, worker->index);
+        }
+        if(vm == NULL) {
+            //Everything left is running on other workers
+            sched_yield();
+            continue;
+        }
+
+        VMStatus status = vmRunFor(vm, scheduler->slice);
+        bool limited = scheduler->cycleLimit > 0 && vm->cycles >= (unsigned long long)scheduler->cycleLimit;
+        //Batch runs don't pace frames, a waiting VM just goes back in line
+        if((status == VM_RUNNING || status == VM_WAITING) && !limited) {
+            workQueuePush(&worker->queue, vm);
+            continue;
+        }
+        if(scheduler->finished != NULL) {
+            scheduler->finished(vm, status);
+        }
+        atomic_fetch_sub(&scheduler->remaining, 1);
+    }
+    return NULL;
+}
+
+//Runs every added VM until it stops, the calling thread works too
+void schedulerRun(Scheduler* scheduler) {
+    for (int i = 1; i < scheduler->workerCount; i++) {
+        pthread_create(&scheduler->workers[i].thread, NULL, workerRun, &scheduler->workers[i]);
+    }
+    workerRun(&scheduler->workers[0]);
+    for (int i = 1; i < scheduler->workerCount; i++) {
+        pthread_join(scheduler->workers[i].thread, NULL);
+    }
+}
+
+void schedulerDestroy(Scheduler* scheduler) {
+    for (int i = 0; i < scheduler->workerCount; i++) {
+        workQueueDestroy(&scheduler->workers[i].queue);
+    }
+    free(scheduler->workers);
+    free(scheduler);
+}
@@ -0,0 +1,45 @@
+#ifndef FAKEOS_SCHEDULER_H
+#define FAKEOS_SCHEDULER_H
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "asm.h"
+
+//VMs waiting for a worker, the owner takes from the front and thieves from the back
+typedef struct {
+    VM** vms;
+    int capacity;
+    int head;
+    int count;
+    pthread_mutex_t lock;
+} WorkQueue;
+
+typedef struct Worker {
+    struct Scheduler* scheduler;
+    int index;
+    pthread_t thread;
+    WorkQueue queue;
+} Worker;
+
+struct Scheduler {
+    Worker* workers;
+    int workerCount;
+    int next; //Worker the next added VM goes to
+
+    long long slice; //Cycles a VM runs before it goes back into a queue
+    long long cycleLimit; //VMs still running after this many cycles are stopped, 0 for no limit
+    atomic_int remaining; //VMs that haven't finished yet
+
+    //Called on the worker thread once a VM stops for good, VM_RUNNING or VM_WAITING if it hit cycleLimit
+    void (*finished)(VM* vm, VMStatus status);
+};
+
+typedef struct Scheduler Scheduler;
+
+Scheduler* schedulerCreate(int workerCount, long long slice);
+void schedulerAdd(Scheduler* scheduler, VM* vm);
+void schedulerRun(Scheduler* scheduler);
+void schedulerDestroy(Scheduler* scheduler);
+
+#endif //FAKEOS_SCHEDULER_H
@@ -0,0 +1,205 @@
+#include "heap.h"
+#include "snapshot.h"
+
+//Every write stamps its page with vm->generation, and each snapshot moves the VM to the next
+//generation. A page differs between the VM and a frame only if its stamp is newer than the frame.
+
+SnapshotRing* snapshotRingCreate(int capacity) {
+    SnapshotRing* ring = malloc(sizeof(SnapshotRing));
+    ring->frames = calloc(capacity, sizeof(Snapshot));
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->count = 0;
+    return ring;
+}
+
+void snapshotRingDestroy(SnapshotRing* ring) {
+    for (int i = 0; i < ring->capacity; i++) {
+        free(ring->frames[i].memory);
+        free(ring->frames[i].memoryMap);
+        free(ring->frames[i].memorySizes);
+        free(ring->frames[i].videoMemory);
+        free(ring->frames[i].images[0]);
+        free(ring->frames[i].images[1]);
+    }
+    free(ring->frames);
+    free(ring);
+}
+
+static int pageLength(int page, int size, int shift) {
+    int start = page << shift;
+    int length = 1 << shift;
+    return start + length > size ? size - start : length;
+}
+
+//memorySizes only covers the heap, so only part of a page may have sizes
+static void copyMemoryPage(VM* vm, unsigned char* memory, bool* memoryMap, unsigned short* memorySizes,
+                           const unsigned char* fromMemory, const bool* fromMemoryMap, const unsigned short* fromMemorySizes,
+                           int page) {
+    int start = page << MEMORY_PAGE_SHIFT;
+    int length = pageLength(page, vm->memorySize, MEMORY_PAGE_SHIFT);
+    memcpy(memory + start, fromMemory + start, length);
+    memcpy(memoryMap + start, fromMemoryMap + start, length * sizeof(bool));
+    if(start < vm->heapSize) {
+        int sizes = start + length > vm->heapSize ? vm->heapSize - start : length;
+        memcpy(memorySizes + start, fromMemorySizes + start, sizes * sizeof(unsigned short));
+    }
+}
+
+static void captureScreen(VM* vm, Snapshot* frame, int index) {
+    Screen* screen = vm->buffers[index];
+    if(screen == NULL) {
+        frame->screens[index] = NULL;
+        return;
+    }
+
+    int size = screen->width * screen->height;
+    if(!frame->valid || frame->screens[index] != screen) {
+        frame->images[index] = realloc(frame->images[index], size);
+        memcpy(frame->images[index], screen->buffer, size);
+        frame->screens[index] = screen;
+        return;
+    }
+
+    for (int page = 0; page < screenPageCount(screen); page++) {
+        if(screen->pageVersions[page] > frame->generation) {
+            int start = page << SCREEN_PAGE_SHIFT;
+            memcpy(frame->images[index] + start, screen->buffer + start, pageLength(page, size, SCREEN_PAGE_SHIFT));
+        }
+    }
+}
+
+static void restoreScreen(VM* vm, Snapshot* frame, int index) {
+    Screen* screen = vm->buffers[index];
+    if(screen == NULL || frame->images[index] == NULL) {
+        return;
+    }
+
+    int size = screen->width * screen->height;
+    Screen* from = frame->screens[index];
+    bool whole = from != screen;
+    if(whole && (from == NULL || from->width * from->height != size)) {
+        return;
+    }
+
+    for (int page = 0; page < screenPageCount(screen); page++) {
+        if(whole || screen->pageVersions[page] > frame->generation) {
+            int start = page << SCREEN_PAGE_SHIFT;
+            memcpy(screen->buffer + start, frame->images[index] + start, pageLength(page, size, SCREEN_PAGE_SHIFT));
+            screen->pageVersions[page] = vm->generation;
+            screenMarkBytesDirty(screen, start, pageLength(page, size, SCREEN_PAGE_SHIFT));
+        }
+    }
+}
+
+void vmSnapshot(VM* vm, SnapshotRing* ring) {
+    Snapshot* frame = &ring->frames[ring->head];
+
+    memcpy(frame->registers, vm->registers, sizeof(frame->registers));
+    frame->ip = vm->ip;
+    frame->sp = vm->sp;
+    memcpy(frame->stack, vm->stack, sizeof(frame->stack));
+    frame->cp = vm->cp;
+    memcpy(frame->callStack, vm->callStack, sizeof(frame->callStack));
+    frame->bp = vm->bp;
+    frame->cmpFlags = vm->cmpFlags;
+    frame->bank = vm->bank;
+    frame->cycles = vm->cycles;
+
+    if(frame->memorySize != vm->memorySize) {
+        frame->memory = realloc(frame->memory, vm->memorySize);
+        frame->memoryMap = realloc(frame->memoryMap, vm->memorySize * sizeof(bool));
+        frame->memorySizes = realloc(frame->memorySizes, vm->heapSize * sizeof(unsigned short));
+        frame->memorySize = vm->memorySize;
+        frame->valid = false;
+    }
+    for (int page = 0; page < vm->memoryPages; page++) {
+        if(!frame->valid || vm->pageVersions[page] > frame->generation) {
+            copyMemoryPage(vm, frame->memory, frame->memoryMap, frame->memorySizes,
+                           vm->memory, vm->memoryMap, vm->memorySizes, page);
+        }
+    }
+    if(frame->videoMemory == NULL) {
+        frame->videoMemory = malloc(VIDEO_MEMORY_SIZE);
+    }
+    for (int page = 0; page < VIDEO_PAGES; page++) {
+        if(!frame->valid || vm->videoPageVersions[page] > frame->generation) {
+            int start = page << MEMORY_PAGE_SHIFT;
+            memcpy(frame->videoMemory + start, vm->videoMemory + start, 1 << MEMORY_PAGE_SHIFT);
+        }
+    }
+    memcpy(frame->sprites, vm->sprites, sizeof(frame->sprites));
+    frame->drawColor = vm->drawColor;
+    frame->penX = vm->penX;
+    frame->penY = vm->penY;
+    frame->tilemap = vm->tilemap;
+    memcpy(frame->input, vm->input, sizeof(frame->input));
+    captureScreen(vm, frame, 0);
+    captureScreen(vm, frame, 1);
+
+    frame->valid = true;
+    frame->generation = vm->generation;
+    vm->generation++;
+
+    ring->head = (ring->head + 1) % ring->capacity;
+    if(ring->count < ring->capacity) {
+        ring->count++;
+    }
+}
+
+//framesBack 0 is the newest snapshot. Newer frames are dropped, the restored one stays the newest.
+bool vmRestore(VM* vm, SnapshotRing* ring, int framesBack) {
+    if(framesBack < 0 || framesBack >= ring->count) {
+        return false;
+    }
+    int index = (ring->head - 1 - framesBack + ring->capacity) % ring->capacity;
+    Snapshot* frame = &ring->frames[index];
+    if(frame->memorySize != vm->memorySize) {
+        return false;
+    }
+
+    memcpy(vm->registers, frame->registers, sizeof(frame->registers));
+    vm->ip = frame->ip;
+    vm->sp = frame->sp;
+    memcpy(vm->stack, frame->stack, sizeof(frame->stack));
+    vm->cp = frame->cp;
+    memcpy(vm->callStack, frame->callStack, sizeof(frame->callStack));
+    vm->bp = frame->bp;
+    vm->cmpFlags = frame->cmpFlags;
+    vmSetBank(vm, frame->bank);
+    vm->cycles = frame->cycles;
+    vm->interrupt = false;
+
+    //Restored pages are stamped as new changes, so every other frame still knows they differ
+    bool restored = false;
+    for (int page = 0; page < vm->memoryPages; page++) {
+        if(vm->pageVersions[page] > frame->generation) {
+            copyMemoryPage(vm, vm->memory, vm->memoryMap, vm->memorySizes,
+                           frame->memory, frame->memoryMap, frame->memorySizes, page);
+            vm->pageVersions[page] = vm->generation;
+            restored = true;
+        }
+    }
+    if(restored) {
+        heapRebuild(vm);
+    }
+    for (int page = 0; page < VIDEO_PAGES; page++) {
+        if(vm->videoPageVersions[page] > frame->generation) {
+            int start = page << MEMORY_PAGE_SHIFT;
+            memcpy(vm->videoMemory + start, frame->videoMemory + start, 1 << MEMORY_PAGE_SHIFT);
+            vm->videoPageVersions[page] = vm->generation;
+        }
+    }
+    memcpy(vm->sprites, frame->sprites, sizeof(frame->sprites));
+    vm->drawColor = frame->drawColor;
+    vm->penX = frame->penX;
+    vm->penY = frame->penY;
+    vm->tilemap = frame->tilemap;
+    memcpy(vm->input, frame->input, sizeof(frame->input));
+    restoreScreen(vm, frame, 0);
+    restoreScreen(vm, frame, 1);
+
+    ring->head = (index + 1) % ring->capacity;
+    ring->count -= framesBack;
+    return true;
+}
@@ -0,0 +1,57 @@
+#ifndef FAKEOS_SNAPSHOT_H
+#define FAKEOS_SNAPSHOT_H
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "asm.h"
+
+//Complete VM state at one point in time. Frames are reused, so taking a snapshot only
+//copies the pages that changed since the frame was last filled.
+typedef struct {
+    bool valid;
+    unsigned int generation; //Holds every change made up to this generation
+
+    unsigned short registers[REGISTER_COUNT];
+    unsigned short ip;
+    unsigned short sp;
+    unsigned short stack[256];
+    unsigned short cp;
+    unsigned short callStack[256];
+    unsigned short bp;
+    unsigned char cmpFlags;
+    unsigned short bank;
+    unsigned long long cycles;
+
+    //Sized like the VM's memory the frame was first filled from
+    unsigned int memorySize;
+    unsigned char* memory;
+    bool* memoryMap;
+    unsigned short* memorySizes;
+
+    unsigned char* videoMemory;
+    Sprite sprites[SPRITE_COUNT];
+    unsigned char drawColor;
+    short penX, penY;
+    Tilemap tilemap;
+    unsigned short input[INPUT_REGISTER_COUNT];
+
+    Screen* screens[2]; //Screens the images were taken from
+    unsigned char* images[2];
+} Snapshot;
+
+//The last frames of a VM, the oldest one gets overwritten
+typedef struct {
+    Snapshot* frames;
+    int capacity;
+    int head; //Slot the next snapshot goes to
+    int count;
+} SnapshotRing;
+
+SnapshotRing* snapshotRingCreate(int capacity);
+void snapshotRingDestroy(SnapshotRing* ring);
+
+//Only call these between runs, not from syscalls
+void vmSnapshot(VM* vm, SnapshotRing* ring);
+bool vmRestore(VM* vm, SnapshotRing* ring, int framesBack);
+
+#endif //FAKEOS_SNAPSHOT_H
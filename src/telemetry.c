@@ -0,0 +1,181 @@
+#define _DEFAULT_SOURCE //clock_gettime under strict C11
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "telemetry.h"
+
+#define TELEMETRY_MAGIC "FOST"
+#define TELEMETRY_VERSION 2
+
+unsigned long long telemetryNow() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (unsigned long long)time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+Telemetry* telemetryCreate() {
+    Telemetry* telemetry = malloc(sizeof(Telemetry));
+    atomic_init(&telemetry->count, 0);
+    return telemetry;
+}
+
+void telemetryDestroy(Telemetry* telemetry) {
+    free(telemetry);
+}
+
+void telemetryRecord(Telemetry* telemetry, const FrameTiming* timing) {
+    unsigned long long count = atomic_load_explicit(&telemetry->count, memory_order_relaxed);
+    telemetry->entries[count & (TELEMETRY_CAPACITY - 1)] = *timing;
+    atomic_store_explicit(&telemetry->count, count + 1, memory_order_release);
+}
+
+int telemetryRead(Telemetry* telemetry, FrameTiming* timings, int max) {
+    unsigned long long count = atomic_load_explicit(&telemetry->count, memory_order_acquire);
+    unsigned long long length = count < TELEMETRY_CAPACITY ? count : TELEMETRY_CAPACITY;
+    if(length > (unsigned long long)max) {
+        length = max;
+    }
+    unsigned long long first = count - length;
+    for (unsigned long long i = 0; i < length; i++) {
+        timings[i] = telemetry->entries[(first + i) & (TELEMETRY_CAPACITY - 1)];
+    }
+
+    //Whatever the writer got to while copying is garbage, drop it. It fills entry now before it
+    //counts it, so that one may be half written already.
+    unsigned long long now = atomic_load_explicit(&telemetry->count, memory_order_acquire);
+    unsigned long long lost = now + 1 - first > TELEMETRY_CAPACITY ? now + 1 - first - TELEMETRY_CAPACITY : 0;
+    if(lost >= length) {
+        return 0;
+    }
+    memmove(timings, timings + lost, (length - lost) * sizeof(FrameTiming));
+    return (int)(length - lost);
+}
+
+//region Summary
+
+static int compareValues(const void* a, const void* b) {
+    unsigned long long left = *(const unsigned long long*)a;
+    unsigned long long right = *(const unsigned long long*)b;
+    return (left > right) - (left < right);
+}
+
+//Nearest rank on the sorted values of one field. With inputOnly only frames answering input count.
+static TimingPercentiles percentiles(const FrameTiming* timings, int count, size_t field, bool inputOnly,
+                                     unsigned long long* values) {
+    TimingPercentiles result = {0};
+    int length = 0;
+    for (int i = 0; i < count; i++) {
+        if(!inputOnly || timings[i].inputTime != 0) {
+            values[length++] = *(const unsigned long long*)((const char*)&timings[i] + field);
+        }
+    }
+    if(length == 0) {
+        return result;
+    }
+    qsort(values, length, sizeof(unsigned long long), compareValues);
+    result.p50 = values[(length - 1) * 50 / 100];
+    result.p99 = values[(length - 1) * 99 / 100];
+    result.max = values[length - 1];
+    return result;
+}
+
+TelemetrySummary telemetrySummarize(Telemetry* telemetry, int frames) {
+    if(frames <= 0 || frames > TELEMETRY_CAPACITY) {
+        frames = TELEMETRY_CAPACITY;
+    }
+    FrameTiming* timings = malloc(sizeof(FrameTiming) * frames);
+    unsigned long long* values = malloc(sizeof(unsigned long long) * frames);
+    int count = telemetryRead(telemetry, timings, frames);
+
+    TelemetrySummary summary;
+    summary.frames = count;
+    summary.cycles = percentiles(timings, count, offsetof(FrameTiming, cycles), false, values);
+    summary.vmTime = percentiles(timings, count, offsetof(FrameTiming, vmTime), false, values);
+    summary.convertTime = percentiles(timings, count, offsetof(FrameTiming, convertTime), false, values);
+    summary.presentTime = percentiles(timings, count, offsetof(FrameTiming, presentTime), false, values);
+    summary.frameTime = percentiles(timings, count, offsetof(FrameTiming, frameTime), false, values);
+    summary.inputFrames = 0;
+    for (int i = 0; i < count; i++) {
+        summary.inputFrames += timings[i].inputTime != 0;
+    }
+    summary.inputLatency = percentiles(timings, count, offsetof(FrameTiming, inputLatency), true, values);
+
+    free(values);
+    free(timings);
+    return summary;
+}
+
+static void printTimes(FILE* file, const char* name, TimingPercentiles times) {
+    fprintf(file, "%-8s p50 %8.3f ms  p99 %8.3f ms  max %8.3f ms\n", name,
+            times.p50 / 1e6, times.p99 / 1e6, times.max / 1e6);
+}
+
+void telemetryPrintSummary(Telemetry* telemetry, FILE* file) {
+    TelemetrySummary summary = telemetrySummarize(telemetry, 0);
+    if(summary.frames == 0) {
+        return;
+    }
+    fprintf(file, "Last %d frames:\n", summary.frames);
+    printTimes(file, "vm", summary.vmTime);
+    printTimes(file, "convert", summary.convertTime);
+    printTimes(file, "present", summary.presentTime);
+    printTimes(file, "frame", summary.frameTime);
+    fprintf(file, "%-8s p50 %8llu     p99 %8llu     max %8llu\n", "cycles",
+            summary.cycles.p50, summary.cycles.p99, summary.cycles.max);
+    if(summary.inputFrames > 0) {
+        fprintf(file, "Input to display over %d frames:\n", summary.inputFrames);
+        printTimes(file, "latency", summary.inputLatency);
+    }
+}
+
+//endregion
+
+//region Export
+
+static void writeWord(FILE* file, unsigned long long value) {
+    for (int i = 0; i < 8; i++) {
+        fputc((int)(value >> i * 8) & 0xFF, file);
+    }
+}
+
+bool telemetryExport(Telemetry* telemetry, const char* path) {
+    const char* extension = strrchr(path, '.');
+    TelemetryFormat format = extension != NULL && strcmp(extension, ".csv") == 0 ? TELEMETRY_CSV : TELEMETRY_BINARY;
+    FILE* file = fopen(path, format == TELEMETRY_CSV ? "w" : "wb");
+    if(file == NULL) {
+        printf("Error opening file\n");
+        return false;
+    }
+
+    FrameTiming* timings = malloc(sizeof(FrameTiming) * TELEMETRY_CAPACITY);
+    int count = telemetryRead(telemetry, timings, TELEMETRY_CAPACITY);
+    if(format == TELEMETRY_CSV) {
+        fprintf(file, "frame,cycles,vm_ns,convert_ns,present_ns,frame_ns,input_latency_ns\n");
+        for (int i = 0; i < count; i++) {
+            FrameTiming* timing = &timings[i];
+            fprintf(file, "%llu,%llu,%llu,%llu,%llu,%llu,%llu\n", timing->frame, timing->cycles, timing->vmTime,
+                    timing->convertTime, timing->presentTime, timing->frameTime, timing->inputLatency);
+        }
+    } else {
+        fwrite(TELEMETRY_MAGIC, 1, 4, file);
+        fputc(TELEMETRY_VERSION, file);
+        writeWord(file, count);
+        for (int i = 0; i < count; i++) {
+            FrameTiming* timing = &timings[i];
+            writeWord(file, timing->frame);
+            writeWord(file, timing->cycles);
+            writeWord(file, timing->vmTime);
+            writeWord(file, timing->convertTime);
+            writeWord(file, timing->presentTime);
+            writeWord(file, timing->frameTime);
+            writeWord(file, timing->inputTime);
+            writeWord(file, timing->inputLatency);
+        }
+    }
+
+    free(timings);
+    fclose(file);
+    return true;
+}
+
+//endregion
@@ -0,0 +1,66 @@
+#ifndef FAKEOS_TELEMETRY_H
+#define FAKEOS_TELEMETRY_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define TELEMETRY_CAPACITY 1024 //Frames kept, power of two
+
+//Where the time of one frame went, all times in nanoseconds
+typedef struct {
+    unsigned long long frame; //Flush number, gaps are frames the presenter never got to
+    unsigned long long cycles; //Guest cycles run since the previous flush
+    unsigned long long vmTime; //Running the guest since the previous flush
+    unsigned long long convertTime; //Palette conversion and texture upload
+    unsigned long long presentTime; //Drawing and presenting, includes waiting for vsync
+    unsigned long long frameTime; //Since the previous presented frame
+    unsigned long long inputTime; //Oldest input event the frame is the first to answer, 0 for none
+    unsigned long long inputLatency; //From that event to the frame being presented
+} FrameTiming;
+
+//The newest frame timings. One thread records, entries are only written once they are a whole
+//capacity old, so a reader only has to check that the ones it copied weren't overwritten meanwhile.
+typedef struct {
+    FrameTiming entries[TELEMETRY_CAPACITY];
+    atomic_ullong count; //Frames recorded so far, frame i is in entries[i % TELEMETRY_CAPACITY]
+} Telemetry;
+
+typedef struct {
+    unsigned long long p50;
+    unsigned long long p99;
+    unsigned long long max;
+} TimingPercentiles;
+
+typedef struct {
+    int frames; //Frames the percentiles are over
+    TimingPercentiles cycles;
+    TimingPercentiles vmTime;
+    TimingPercentiles convertTime;
+    TimingPercentiles presentTime;
+    TimingPercentiles frameTime;
+    int inputFrames; //Frames answering input, the latency percentiles are over these
+    TimingPercentiles inputLatency;
+} TelemetrySummary;
+
+typedef enum {
+    TELEMETRY_CSV, //Header line, then one line per frame
+    TELEMETRY_BINARY, //"FOST", version, count, then the fields of each frame as little endian 64 bit words
+} TelemetryFormat;
+
+//Monotonic clock in nanoseconds
+unsigned long long telemetryNow();
+
+Telemetry* telemetryCreate();
+void telemetryDestroy(Telemetry* telemetry);
+//Only call from one thread
+void telemetryRecord(Telemetry* telemetry, const FrameTiming* timing);
+//Copies up to max of the newest frames, oldest first, and returns how many
+int telemetryRead(Telemetry* telemetry, FrameTiming* timings, int max);
+//Over up to the last frames recorded, 0 for all that are kept
+TelemetrySummary telemetrySummarize(Telemetry* telemetry, int frames);
+void telemetryPrintSummary(Telemetry* telemetry, FILE* file);
+//Picks the format from the extension, .csv or anything else for binary
+bool telemetryExport(Telemetry* telemetry, const char* path);
+
+#endif //FAKEOS_TELEMETRY_H
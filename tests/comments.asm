@@ -0,0 +1,8 @@
+/ A lone slash comments out the rest of the line
+//So does one stuck to the text
+mov @0 #3 //after an instruction
+cmp @0 #3 /same here
+jeq _done
+mov @0 #1
+_done: //after a label
+sys #0
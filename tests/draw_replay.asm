@@ -0,0 +1,18 @@
+mov @1 #0
+_frame:
+cls #1
+col #4
+pen #-10 #-10
+rec #100 #100
+col #9
+pen #100 #50
+box #150 #80
+col #14
+pen #-32768 #299
+lin #32767 #0
+hln #390 #5 #50
+sys #2
+add @1 @1 #1
+cmp @1 #5
+jlt _frame
+sys #0
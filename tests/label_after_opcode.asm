@@ -0,0 +1,4 @@
+jmp ret
+nop
+ret:
+sys #0
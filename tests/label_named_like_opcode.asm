@@ -0,0 +1,5 @@
+jmp _start
+ret:
+sys #0
+_start:
+jmp ret
@@ -0,0 +1,3 @@
+mov @1 #-1
+sys #1
+sys #0